@@ -4,6 +4,21 @@
 #include <cstring>
 #include <map>
 #include <fstream>
+#include <chrono>
+#include <sstream>
+#include <filesystem>
+#include <charconv>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <signal.h>
 #include "Part12.h"
 
 const std::map<TokenType, std::string> tokenTypeToStr {
@@ -25,6 +40,16 @@ const std::map<TokenType, std::string> tokenTypeToStr {
     {TokenType::IntegerDiv, "IntegerDiv"},
     {TokenType::Integer,    "Integer"   },
     {TokenType::Real,       "Real"      },
+    {TokenType::While,      "While"     },
+    {TokenType::Do,         "Do"        },
+    {TokenType::Equal,      "Equal"     },
+    {TokenType::NotEqual,   "NotEqual"  },
+    {TokenType::Less,       "Less"      },
+    {TokenType::LessEqual,  "LessEqual" },
+    {TokenType::Greater,    "Greater"   },
+    {TokenType::GreaterEqual, "GreaterEqual"},
+    {TokenType::For,        "For"       },
+    {TokenType::To,         "To"        },
     {TokenType::TYPE_EOF,   "TYPE_EOF"}
 };
 
@@ -34,35 +59,222 @@ std::ostream& operator<<(std::ostream& os, const TokenType& tk) {
 }
 
 std::ostream& operator<<(std::ostream& os, const Token& tk) {
-    os << "Token (" << tk.type_ << ", " << tk.value_ << ")";
+    if (tk.type_ == TokenType::ID) {
+        os << "Token (" << tk.type_ << ", " << Interner::name(tk.atom_) << ")";
+    } else {
+        os << "Token (" << tk.type_ << ", " << tk.value_ << ")";
+    }
     return os;
 }
 
+Interner& Interner::global() {
+    static Interner interner;
+    return interner;
+}
+
+uint32_t Interner::hash(std::string_view text) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (char c : text) {
+        h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return h;
+}
+
+void Interner::Shard::grow() {
+    std::vector<Slot> old;
+    old.swap(slots);
+    slots.resize(old.empty() ? 64 : old.size() * 2);
+    size_t mask = slots.size() - 1;
+    for (const Slot& slot : old) {
+        if (slot.atom != NO_ATOM) {
+            size_t pos = (slot.hash >> 6) & mask;
+            while (slots[pos].atom != NO_ATOM) {
+                pos = (pos + 1) & mask;
+            }
+            slots[pos] = slot;
+        }
+    }
+}
+
+std::string& Interner::slotFor(Atom atom) {
+    size_t chunk = atom >> CHUNK_BITS;
+    if (chunk >= MAX_CHUNKS) {
+        throw std::runtime_error("Too many identifiers");
+    }
+    std::string* names = chunks_[chunk].load(std::memory_order_acquire);
+    if (names == nullptr) {
+        std::string* fresh = new std::string[1 << CHUNK_BITS];
+        if (chunks_[chunk].compare_exchange_strong(names, fresh, std::memory_order_acq_rel)) {
+            names = fresh;
+        } else {
+            delete[] fresh;
+        }
+    }
+    return names[atom & ((1 << CHUNK_BITS) - 1)];
+}
+
+Atom Interner::intern(std::string_view text) {
+    Interner& self = global();
+    uint32_t h = hash(text);
+    // low bits pick the shard, the next ones the slot inside it
+    Shard& shard = self.shards_[h & (SHARD_COUNT - 1)];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if ((shard.size + 1) * 2 > shard.slots.size()) {
+        shard.grow();
+    }
+    size_t mask = shard.slots.size() - 1;
+    size_t pos = (h >> 6) & mask;
+    for (; shard.slots[pos].atom != NO_ATOM; pos = (pos + 1) & mask) {
+        if (shard.slots[pos].hash == h && name(shard.slots[pos].atom) == text) {
+            return shard.slots[pos].atom;
+        }
+    }
+
+    Atom atom = self.nextAtom_.fetch_add(1, std::memory_order_relaxed);
+    self.slotFor(atom) = text;
+    shard.slots[pos] = Slot{h, atom};
+    shard.size++;
+    return atom;
+}
+
+const std::string& Interner::name(Atom atom) {
+    std::string* names = global().chunks_[atom >> CHUNK_BITS].load(std::memory_order_acquire);
+    return names[atom & ((1 << CHUNK_BITS) - 1)];
+}
+
+void SourceMap::index() const {
+    indexed_ = true;
+    if (readFile_) {
+        std::ifstream file(name_, std::ios::binary);
+        if (file.is_open()) {
+            text_.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            hasText_ = true;
+        }
+    }
+    if (!hasText_) {
+        return;
+    }
+    lineStarts_.push_back(0);
+    for (const char* p = text_.data(), *end = p + text_.size();
+         (p = static_cast<const char*>(memchr(p, '\n', end - p))) != nullptr; p++) {
+        lineStarts_.push_back(p + 1 - text_.data());
+    }
+    // only the line starts are needed from now on
+    std::string().swap(text_);
+}
+
+SourceLocation SourceMap::locate(uint32_t offset) const {
+    if (!indexed_) {
+        index();
+    }
+    if (lineStarts_.empty()) {
+        return {0, 0};
+    }
+    auto next = std::upper_bound(lineStarts_.begin(), lineStarts_.end(), offset);
+    uint32_t line = next - lineStarts_.begin();
+    return {line, offset - *(next - 1) + 1};
+}
+
+std::string SourceMap::format(uint32_t offset) const {
+    SourceLocation location = locate(offset);
+    if (location.line == 0) {
+        return name_ + ", offset " + std::to_string(offset);
+    }
+    return name_ + ":" + std::to_string(location.line) + ":" + std::to_string(location.column);
+}
+
 Lexer::Lexer(std::string&& text) {
-    textStart_ = (char*)malloc(text.length());
+    textStart_ = (char*)malloc(text.length() + 1);
     memcpy(textStart_, text.data(), text.length());
     textEnd_ = textStart_ + text.length() - 1;
+    currentPtr_ = text.empty() ? nullptr : textStart_;
+    initKeywords();
+}
+
+Lexer::Lexer(int fd) : fd_(fd) {
+    textStart_ = (char*)malloc(CHUNK_SIZE);
+    textEnd_ = textStart_ - 1;
     currentPtr_ = textStart_;
-    RESERVED_KEYWORDS = {
-        {"PROGRAM", Token(TokenType::Program, "PROGRAM")},
-        {"VAR", Token(TokenType::Var, "VAR")},
-        {"DIV", Token(TokenType::IntegerDiv, "DIV")},
-        {"INTEGER", Token(TokenType::Integer, "INTEGER")},
-        {"REAL", Token(TokenType::Real, "REAL")},
-        {"BEGIN", Token(TokenType::Begin, "BEGIN")},
-        {"END", Token(TokenType::End, "End")},
-        {"PROCEDURE", Token(TokenType::Procedure, "Procedure")}
+    if (!refill()) {
+        currentPtr_ = nullptr;
+    }
+    initKeywords();
+}
+
+Lexer::Lexer(const char* text, size_t size) : ownsText_(false) {
+    textStart_ = const_cast<char*>(text);
+    textEnd_ = textStart_ + size - 1;
+    currentPtr_ = size == 0 ? nullptr : textStart_;
+    initKeywords();
+}
+
+Lexer::~Lexer() {
+    if (ownsText_) {
+        free(textStart_);
+    }
+}
+
+void Lexer::initKeywords() {
+    const Token keywords[] = {
+        Token(TokenType::Program, "PROGRAM"),
+        Token(TokenType::Var, "VAR"),
+        Token(TokenType::IntegerDiv, "DIV"),
+        Token(TokenType::Integer, "INTEGER"),
+        Token(TokenType::Real, "REAL"),
+        Token(TokenType::Begin, "BEGIN"),
+        Token(TokenType::End, "END"),
+        Token(TokenType::Procedure, "PROCEDURE"),
+        Token(TokenType::While, "WHILE"),
+        Token(TokenType::Do, "DO"),
+        Token(TokenType::For, "FOR"),
+        Token(TokenType::To, "TO"),
     };
+    for (const Token& keyword : keywords) {
+        Atom atom = Interner::intern(keyword.value_);
+        RESERVED_KEYWORDS.emplace(atom, Token(keyword.type_, keyword.value_, atom));
+    }
+}
+
+bool Lexer::refill() {
+    if (fd_ < 0) {
+        return false;
+    }
+    char* keepFrom = tokenStart_ != nullptr ? tokenStart_ : currentPtr_;
+    size_t keep = textEnd_ + 1 - keepFrom;
+    base_ += keepFrom - textStart_;
+    if (keep >= CHUNK_SIZE) {
+        throw std::runtime_error("Token too long");
+    }
+    memmove(textStart_, keepFrom, keep);
+    currentPtr_ = textStart_ + (currentPtr_ - keepFrom);
+    if (tokenStart_ != nullptr) {
+        tokenStart_ = textStart_;
+    }
+    textEnd_ = textStart_ + keep - 1;
+
+    ssize_t n;
+    do {
+        n = read(fd_, textStart_ + keep, CHUNK_SIZE - keep);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        throw std::runtime_error("Failed to read input");
+    }
+    textEnd_ += n;
+    return n > 0;
 }
 
 void Lexer::advance() {
     currentPtr_++;
-    if (currentPtr_ > textEnd_) {
+    if (currentPtr_ > textEnd_ && !refill()) {
         currentPtr_ = nullptr;
     }
 }
 
 char* Lexer::peek() {
+    if (currentPtr_ == textEnd_) {
+        refill();
+    }
     char* peekPtr = currentPtr_ + 1;
     if (peekPtr > textEnd_) {
         return nullptr;
@@ -83,50 +295,70 @@ void Lexer::skipWhiteSpace() {
 */
 Token Lexer::number() {
     // Return a (multidigit) integer consumed from the input.
-    std::string result;
+    tokenStart_ = currentPtr_;
     while (currentPtr_ != nullptr && std::isdigit(*currentPtr_)) {
-        result += *currentPtr_;
         advance();
     }
 
-    if (*currentPtr_ == '.') {
-        result += *currentPtr_;
+    TokenType type = TokenType::IntegerConst;
+    if (currentPtr_ != nullptr && *currentPtr_ == '.') {
+        type = TokenType::RealConst;
         advance();
 
         while (currentPtr_ != nullptr && std::isdigit(*currentPtr_)) {
-            result += *currentPtr_;
             advance();
         }
-        
-        return Token{TokenType::RealConst, result};
-    } else {
-        return Token{TokenType::IntegerConst, result};
     }
+
+    const char* end = currentPtr_ != nullptr ? currentPtr_ : textEnd_ + 1;
+    std::string result(tokenStart_, end - tokenStart_);
+    tokenStart_ = nullptr;
+    return Token{type, result};
 }
 
 void Lexer::error() {
-    throw std::runtime_error("Invalid character");
+    throw SourceError(offsetOf(currentPtr_), "Invalid character");
 }
 
 Token Lexer::_id() {
-    std::string result;
+    tokenStart_ = currentPtr_;
     while (currentPtr_ != nullptr && std::isalnum(*currentPtr_)) {
-        result += *currentPtr_;
         advance();
     }
+    const char* end = currentPtr_ != nullptr ? currentPtr_ : textEnd_ + 1;
 
-    auto iter = RESERVED_KEYWORDS.insert(std::make_pair(result, Token(TokenType::ID, result)));
-    return iter.first->second;
+    Atom atom = Interner::intern(std::string_view(tokenStart_, end - tokenStart_));
+    tokenStart_ = nullptr;
+    auto iter = RESERVED_KEYWORDS.find(atom);
+    if (iter != RESERVED_KEYWORDS.end()) {
+        return iter->second;
+    }
+    return Token(TokenType::ID, atom);
 }
 
 void Lexer::skipComment() {
-    while (*currentPtr_ != '}') {
+    while (currentPtr_ != nullptr && *currentPtr_ != '}') {
         advance();
     }
+    if (currentPtr_ == nullptr) {
+        error();
+    }
     advance(); // the closing curly brace
 }
 
 Token Lexer::getNextToken() {
+    Token tk = scanToken();
+    tk.offset_ = tokenOffset_;
+    return tk;
+}
+
+uint32_t Lexer::offsetOf(const char* p) const {
+    uint64_t offset = base_ + ((p != nullptr ? p : textEnd_ + 1) - textStart_);
+    // beyond 4 GiB offsets stick at the limit
+    return offset < UINT32_MAX ? static_cast<uint32_t>(offset) : UINT32_MAX;
+}
+
+Token Lexer::scanToken() {
     while (currentPtr_ != nullptr) {
         if (std::isspace(*currentPtr_)) {
             skipWhiteSpace();
@@ -138,6 +370,8 @@ Token Lexer::getNextToken() {
             continue;
         }
 
+        tokenOffset_ = offsetOf(currentPtr_);
+
         if (std::isdigit(*currentPtr_)) {
             return number();
         }
@@ -171,7 +405,7 @@ Token Lexer::getNextToken() {
             return _id();
         }
 
-        if (*currentPtr_ == ':' && *peek() == '=') {
+        if (*currentPtr_ == ':' && peek() != nullptr && *peek() == '=') {
             advance();
             advance();
             return Token(TokenType::Assign, ":=");
@@ -202,108 +436,451 @@ Token Lexer::getNextToken() {
             return Token(TokenType::FloatDiv, "/");
         }
 
+        if (*currentPtr_ == '=') {
+            advance();
+            return Token(TokenType::Equal, "=");
+        }
+
+        if (*currentPtr_ == '<' && peek() != nullptr && (*peek() == '>' || *peek() == '=')) {
+            advance();
+            bool notEqual = *currentPtr_ == '>';
+            advance();
+            return notEqual ? Token(TokenType::NotEqual, "<>") : Token(TokenType::LessEqual, "<=");
+        }
+
+        if (*currentPtr_ == '<') {
+            advance();
+            return Token(TokenType::Less, "<");
+        }
+
+        if (*currentPtr_ == '>' && peek() != nullptr && *peek() == '=') {
+            advance();
+            advance();
+            return Token(TokenType::GreaterEqual, ">=");
+        }
+
+        if (*currentPtr_ == '>') {
+            advance();
+            return Token(TokenType::Greater, ">");
+        }
+
         error();
     }
 
+    tokenOffset_ = offsetOf(nullptr);
     return Token(TokenType::TYPE_EOF, "\0");
 }
 
-Parser::Parser(std::unique_ptr<Lexer>&& lexer) : 
-                lexer_(std::move(lexer)), 
-                currentToken_(lexer_->getNextToken()) {}
+void Lexer::fill(TokenRing& ring) {
+    while (!ring.full()) {
+        Token tk = getNextToken();
+        bool last = tk.type_ == TokenType::TYPE_EOF;
+        ring.push(std::move(tk));
+        if (last) {
+            break;
+        }
+    }
+}
 
-void Parser::eat(TokenType tktype) {
-    if (currentToken_.type_ == tktype) {
-        currentToken_ = lexer_->getNextToken();
-    } else {
-        error();
+/*
+* ITIMER_PROF delivers SIGPROF to any thread of the process. Helper threads
+* start with it blocked, so Profiler samples only ever run on the thread
+* that interprets and never in two handlers at once.
+*/
+template <typename... Args>
+static std::thread startHelperThread(Args&&... args) {
+    sigset_t profile;
+    sigset_t saved;
+    sigemptyset(&profile);
+    sigaddset(&profile, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &profile, &saved);
+    // the new thread inherits the mask of this one
+    std::thread thread;
+    try {
+        thread = std::thread(std::forward<Args>(args)...);
+    } catch (...) {
+        pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+        throw;
     }
+    pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+    return thread;
 }
 
-AST* Parser::factor() { 
-    Token token = currentToken_;
-    if (currentToken_.type_ == TokenType::IntegerConst) {
-        eat(TokenType::IntegerConst);
-        return new Num(token);
-    }  else if (currentToken_.type_ == TokenType::RealConst) {
-        eat(TokenType::RealConst);
-        return new Num(token);
-    } else if (currentToken_.type_ == TokenType::LParen) {
-        eat(TokenType::LParen);
-        AST* node = expr();
-        eat(TokenType::RParen);
-        return node;
-    } else if (currentToken_.type_ == TokenType::PLUS) {
-        eat(TokenType::PLUS);
-        AST* node = factor();
-        return new UnaryOp(token, node);
-    } else if (currentToken_.type_ == TokenType::MINUS) {
-        eat(TokenType::MINUS);
-        AST* node = factor();
-        return new UnaryOp(token, node);
-    } else if (currentToken_.type_ == TokenType::ID) {
-        return variable();
-    }
-    
-    error();
-    return nullptr;
+TokenPipeline::TokenPipeline(std::unique_ptr<Lexer>&& lexer) :
+                lexer_(std::move(lexer)),
+                batches_(new Batch[QUEUE_DEPTH]) {
+    thread_ = startHelperThread(&TokenPipeline::produce, this);
+}
+
+TokenPipeline::~TokenPipeline() {
+    stop_.store(true, std::memory_order_relaxed);
+    thread_.join();
+}
+
+void TokenPipeline::produce() {
+    try {
+        bool last = false;
+        while (!last) {
+            size_t tail = tail_.load(std::memory_order_relaxed);
+            while (tail - head_.load(std::memory_order_acquire) == QUEUE_DEPTH) {
+                if (stop_.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                std::this_thread::yield();
+            }
+
+            Batch& batch = batches_[tail % QUEUE_DEPTH];
+            batch.count = 0;
+            while (!last && batch.count < BATCH_SIZE) {
+                batch.tokens[batch.count] = lexer_->getNextToken();
+                last = batch.tokens[batch.count].type_ == TokenType::TYPE_EOF;
+                batch.count++;
+            }
+            tail_.store(tail + 1, std::memory_order_release);
+        }
+    } catch (...) {
+        error_ = std::current_exception();
+    }
+    finished_.store(true, std::memory_order_release);
 }
 
-AST* Parser::term() {
-    AST* result = factor();
+void TokenPipeline::fill(TokenRing& ring) {
+    while (!ring.full()) {
+        if (eof_) {
+            ring.push(Token(TokenType::TYPE_EOF, "\0"));
+            return;
+        }
 
-    while (currentToken_.type_ == TokenType::MUL || currentToken_.type_ == TokenType::FloatDiv 
-                            || currentToken_.type_ == TokenType::IntegerDiv) {
-        Token op = currentToken_;
-        if (currentToken_.type_ == TokenType::MUL) {
-            eat(TokenType::MUL);
-        } else if (currentToken_.type_ == TokenType::IntegerDiv) {
-            eat(TokenType::IntegerDiv);
-        } else if (currentToken_.type_ == TokenType::FloatDiv) {
-            eat(TokenType::FloatDiv);
+        size_t head = head_.load(std::memory_order_relaxed);
+        while (head == tail_.load(std::memory_order_acquire)) {
+            // re-check the queue after finished_, the last batch may have just landed
+            if (finished_.load(std::memory_order_acquire) && head == tail_.load(std::memory_order_acquire)) {
+                std::rethrow_exception(error_);
+            }
+            std::this_thread::yield();
         }
 
-        result = new BinOp(result, op, factor());
+        Batch& batch = batches_[head % QUEUE_DEPTH];
+        while (!ring.full() && readPos_ < batch.count) {
+            eof_ = batch.tokens[readPos_].type_ == TokenType::TYPE_EOF;
+            ring.push(std::move(batch.tokens[readPos_++]));
+            if (eof_) {
+                return;
+            }
+        }
+        if (readPos_ == batch.count) {
+            readPos_ = 0;
+            head_.store(head + 1, std::memory_order_release);
+        }
     }
+}
 
-    return result;
+Arena::~Arena() {
+    for (auto it = destructors_.rbegin(); it != destructors_.rend(); ++it) {
+        it->second(it->first);
+    }
+    for (char* block : blocks_) {
+        free(block);
+    }
 }
 
-AST* Parser::expr() {
-    AST* result = term();
+void Arena::reset() {
+    for (auto it = destructors_.rbegin(); it != destructors_.rend(); ++it) {
+        it->second(it->first);
+    }
+    destructors_.clear();
+    if (blocks_.empty()) {
+        return;
+    }
+    for (size_t i = 1; i < blocks_.size(); i++) {
+        free(blocks_[i]);
+    }
+    blocks_.resize(1);
+    cur_ = blocks_[0];
+    end_ = blocks_[0] + BLOCK_SIZE;
+    used_ = 0;
+}
 
-    while (currentToken_.type_ == TokenType::PLUS || currentToken_.type_ == TokenType::MINUS) {
-        Token tk = currentToken_;
-        if (currentToken_.type_ == TokenType::PLUS) {
-            eat(TokenType::PLUS);
-        } else if (currentToken_.type_ == TokenType::MINUS) {
-            eat(TokenType::MINUS);
+void* Arena::allocate(size_t size, size_t align) {
+    if (size > limit_ - used_) {
+        throw std::runtime_error("Arena limit of " + std::to_string(limit_) + " bytes exceeded");
+    }
+    uintptr_t aligned = (reinterpret_cast<uintptr_t>(cur_) + align - 1) & ~(uintptr_t)(align - 1);
+    if (cur_ == nullptr || aligned + size > reinterpret_cast<uintptr_t>(end_)) {
+        size_t blockSize = std::max(BLOCK_SIZE, size + align);
+        char* block = (char*)malloc(blockSize);
+        if (block == nullptr) {
+            throw std::bad_alloc();
         }
+        blocks_.push_back(block);
+        cur_ = block;
+        end_ = block + blockSize;
+        aligned = (reinterpret_cast<uintptr_t>(cur_) + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    cur_ = reinterpret_cast<char*>(aligned + size);
+    used_ += size;
+    return reinterpret_cast<void*>(aligned);
+}
+
+// index of the pool worker running on this thread, -1 elsewhere
+static thread_local long currentWorker = -1;
+
+ThreadPool::ThreadPool(size_t threads) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; i++) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        workers_[i]->thread = startHelperThread(&ThreadPool::workerLoop, this, i);
+    }
+}
 
-        result = new BinOp(result, tk, term());
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        stop_ = true;
+    }
+    wakeup_.notify_all();
+    for (auto& worker : workers_) {
+        worker->thread.join();
     }
+}
 
-    return result;
+void ThreadPool::submit(std::function<void()> task) {
+    size_t index = currentWorker >= 0 ? currentWorker : nextWorker_++ % workers_.size();
+    {
+        std::lock_guard<std::mutex> lock(workers_[index]->mutex);
+        workers_[index]->tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        queued_++;
+    }
+    wakeup_.notify_one();
+}
+
+bool ThreadPool::take(size_t self, std::function<void()>& task) {
+    {
+        Worker& own = *workers_[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queued_--;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers_.size(); i++) {
+        Worker& victim = *workers_[(self + i) % workers_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queued_--;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::runOne() {
+    std::function<void()> task;
+    size_t self = currentWorker >= 0 ? currentWorker : 0;
+    if (!take(self, task)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::workerLoop(size_t index) {
+    currentWorker = index;
+    std::function<void()> task;
+    while (true) {
+        if (take(index, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleepMutex_);
+        wakeup_.wait(lock, [this] { return stop_ || queued_ > 0; });
+        if (stop_ && queued_ == 0) {
+            return;
+        }
+    }
+}
+
+void TaskGroup::run(std::function<void()> task) {
+    pending_++;
+    pool_.submit([this, task = std::move(task)] {
+        try {
+            task();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(errorMutex_);
+            if (error_ == nullptr) {
+                error_ = std::current_exception();
+            }
+        }
+        pending_--;
+    });
+}
+
+void TaskGroup::drain() noexcept {
+    // pool tasks do not throw, those of run() catch everything
+    while (pending_ > 0) {
+        if (!pool_.runOne()) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void TaskGroup::wait() {
+    drain();
+    if (error_ != nullptr) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+Parser::Parser(std::unique_ptr<Lexer>&& lexer, bool pipelined, Arena* arena) :
+                lexer_(std::move(lexer)), arena_(arena) {
+    if (pipelined) {
+        pipeline_ = std::make_unique<TokenPipeline>(std::move(lexer_));
+    }
+    fillTokens();
+    currentToken_ = &tokens_.at(0);
+}
+
+void Parser::fillTokens() {
+    if (pipeline_ != nullptr) {
+        pipeline_->fill(tokens_);
+    } else {
+        lexer_->fill(tokens_);
+    }
+}
+
+void Parser::eat(TokenType tktype) {
+    if (currentToken_->type_ == tktype) {
+        tokens_.pop();
+        if (tokens_.size() == 0) {
+            fillTokens();
+        }
+        currentToken_ = &tokens_.at(0);
+    } else {
+        error();
+    }
+}
+
+const Token& Parser::peek(size_t k) {
+    assert(k < TokenRing::CAPACITY);
+    if (tokens_.size() <= k) {
+        fillTokens();
+        if (tokens_.size() <= k) {
+            // the input ended, the last token in the ring is EOF
+            return tokens_.at(tokens_.size() - 1);
+        }
+    }
+    return tokens_.at(k);
+}
+
+thread_local unsigned ExpressionDepth::depth_ = 0;
+thread_local unsigned StatementDepth::depth_ = 0;
+
+constexpr Parser::BindingPowers Parser::makeBindingPowers() {
+    BindingPowers powers{};
+    powers[static_cast<size_t>(TokenType::PLUS)] = {30, 10};
+    powers[static_cast<size_t>(TokenType::MINUS)] = {30, 10};
+    powers[static_cast<size_t>(TokenType::MUL)] = {0, 20};
+    powers[static_cast<size_t>(TokenType::IntegerDiv)] = {0, 20};
+    powers[static_cast<size_t>(TokenType::FloatDiv)] = {0, 20};
+    return powers;
+}
+
+const Parser::BindingPowers Parser::BINDING_POWERS = makeBindingPowers();
+
+AST* Parser::expr() {
+    size_t operandBase = operands_.size();
+    size_t operatorBase = operators_.size();
+    for (;;) {
+        // prefix operators and open parens, then an operand
+        TokenType type = currentToken_->type_;
+        while (bindingPower(type).prefix != 0 || type == TokenType::LParen) {
+            operators_.push_back({*currentToken_, bindingPower(type).prefix, true});
+            eat(type);
+            type = currentToken_->type_;
+        }
+        if (type == TokenType::IntegerConst || type == TokenType::RealConst) {
+            operands_.push_back(make<Num>(*currentToken_));
+            eat(type);
+        } else if (type == TokenType::ID) {
+            operands_.push_back(variable());
+        } else {
+            error();
+        }
+
+        // closing parens, then an infix operator or the end of the expression
+        for (;;) {
+            type = currentToken_->type_;
+            uint8_t power = bindingPower(type).infix;
+            if (power != 0) {
+                while (operators_.size() > operatorBase && operators_.back().power >= power) {
+                    reduce();
+                }
+                operators_.push_back({*currentToken_, power, false});
+                eat(type);
+                break;
+            }
+
+            while (operators_.size() > operatorBase && operators_.back().power != 0) {
+                reduce();
+            }
+            if (operators_.size() == operatorBase) {
+                AST* result = operands_.back();
+                operands_.resize(operandBase);
+                return result;
+            }
+            // reports a missing paren at the current token
+            eat(TokenType::RParen);
+            operators_.pop_back();
+        }
+    }
+}
+
+void Parser::reduce() {
+    PendingOperator op = std::move(operators_.back());
+    operators_.pop_back();
+    AST* right = operands_.back();
+    if (op.prefix) {
+        operands_.back() = make<UnaryOp>(op.token, right);
+    } else {
+        operands_.pop_back();
+        operands_.back() = make<BinOp>(operands_.back(), std::move(op.token), right);
+    }
 }
 
 Program* Parser::program() {
+    uint32_t offset = currentToken_->offset_;
     eat(TokenType::Program);
     Var* varNode = variable();
-    std::string progName = varNode->value_;
+    Atom progName = varNode->value_;
     eat(TokenType::Semi);
     Block* blk = block();
 
-    Program* prog = new Program(progName, blk);
+    Program* prog = make<Program>(progName, blk);
+    prog->offset_ = offset;
     eat(TokenType::Dot);
     return prog;
 }
 
 Compound* Parser::compoundStatement() {
+    uint32_t offset = currentToken_->offset_;
     eat(TokenType::Begin);
     std::list<AST*> nodes =  statementList();
     eat(TokenType::End);
 
-    Compound* root = new Compound();
+    Compound* root = make<Compound>();
+    root->offset_ = offset;
     for (AST* node : nodes) {
         root->children_.push_back(node);
     }
@@ -316,13 +893,13 @@ std::list<AST*> Parser::statementList() {
     std::list<AST*> result;
     result.push_back(node);
 
-    while (currentToken_.type_ == TokenType::Semi) {
+    while (currentToken_->type_ == TokenType::Semi) {
         eat(TokenType::Semi);
         result.push_back(statement());
     }
 
     // why in the last should we judge ID, is other token not important?
-    if (currentToken_.type_ == TokenType::ID) {
+    if (currentToken_->type_ == TokenType::ID) {
         error();
     }
 
@@ -330,64 +907,139 @@ std::list<AST*> Parser::statementList() {
 }
 
 AST* Parser::statement() {
+    enterNesting();
+    AST* node;
     // how to judge it is compund or assign or empty
-    // just using token type
-    if (currentToken_.type_ == TokenType::Begin) {
-        return compoundStatement();
-    } else if (currentToken_.type_ == TokenType::ID) {
-        return assignmentStatement();
+    // just using token type, an ID needs one token of lookahead
+    if (currentToken_->type_ == TokenType::Begin) {
+        node = compoundStatement();
+    } else if (currentToken_->type_ == TokenType::ID && peek(1).type_ == TokenType::LParen) {
+        node = proccallStatement();
+    } else if (currentToken_->type_ == TokenType::ID) {
+        node = assignmentStatement();
+    } else if (currentToken_->type_ == TokenType::While) {
+        node = whileStatement();
+    } else if (currentToken_->type_ == TokenType::For) {
+        node = forStatement();
     } else {
-        return empty();
+        node = empty();
+    }
+    nesting_--;
+    return node;
+}
+
+void Parser::enterNesting() {
+    if (nesting_ == MAX_NESTING) {
+        throw SourceError(currentToken_->offset_, "Statements nested too deeply");
+    }
+    nesting_++;
+}
+
+AST* Parser::whileStatement() {
+    uint32_t offset = currentToken_->offset_;
+    eat(TokenType::While);
+    AST* cond = condition();
+    eat(TokenType::Do);
+    AST* body = statement();
+
+    AST* node = make<While>(cond, body);
+    node->offset_ = offset;
+    return node;
+}
+
+AST* Parser::forStatement() {
+    uint32_t offset = currentToken_->offset_;
+    eat(TokenType::For);
+    Var* control = variable();
+    eat(TokenType::Assign);
+    AST* from = expr();
+    eat(TokenType::To);
+    AST* to = expr();
+    eat(TokenType::Do);
+    AST* body = statement();
+
+    AST* node = make<For>(control, from, to, body);
+    node->offset_ = offset;
+    return node;
+}
+
+AST* Parser::condition() {
+    AST* left = expr();
+    TokenType type = currentToken_->type_;
+    if (type < TokenType::Equal || type > TokenType::GreaterEqual) {
+        error();
     }
+    Token op = *currentToken_;
+    eat(type);
+    return make<BinOp>(left, std::move(op), expr());
 }
 
 AST* Parser::assignmentStatement() {
     Var* left = variable();
-    Token op = currentToken_;
+    Token op = *currentToken_;
     eat(TokenType::Assign);
     AST* right = expr();
-    AST* node = new Assign(left, op, right);
+    AST* node = make<Assign>(left, op, right);
+    node->offset_ = left->offset_;
 
     return node;
 }
 
+AST* Parser::proccallStatement() {
+    Token token = *currentToken_;
+    eat(TokenType::ID);
+    eat(TokenType::LParen);
+    eat(TokenType::RParen);
+
+    return make<ProcedureCall>(token);
+}
+
 Var* Parser::variable() {
-    Var* node = new Var(currentToken_);
+    Var* node = make<Var>(*currentToken_);
     eat(TokenType::ID);
 
     return node;
 }
 
 AST* Parser::empty() {
-    return new NoOp();
+    AST* node = make<NoOp>();
+    node->offset_ = currentToken_->offset_;
+    return node;
 }
 
 Block* Parser::block() {
+    enterNesting();
+    uint32_t offset = currentToken_->offset_;
     std::list<AST*> decls = declarations();
     Compound* compState = compoundStatement();
+    nesting_--;
 
-    return new Block(decls, compState);
+    Block* blk = make<Block>(decls, compState);
+    blk->offset_ = offset;
+    return blk;
 }
 
 std::list<AST*> Parser::declarations() {
     std::list<AST*> decls;
 
-    if (currentToken_.type_ == TokenType::Var) {
+    if (currentToken_->type_ == TokenType::Var) {
         eat(TokenType::Var);
-        while (currentToken_.type_ == TokenType::ID) {
+        while (currentToken_->type_ == TokenType::ID) {
             std::list<VarDecl*> tmpDecls = variableDeclaration();
             decls.insert(decls.end(), tmpDecls.begin(), tmpDecls.end());
             eat(TokenType::Semi);
         }
     }
 
-    while (currentToken_.type_ == TokenType::Procedure) {
+    while (currentToken_->type_ == TokenType::Procedure) {
+        uint32_t offset = currentToken_->offset_;
         eat(TokenType::Procedure);
-        std::string procName = currentToken_.value_;
+        Atom procName = currentToken_->atom_;
         eat(TokenType::ID);
         eat(TokenType::Semi);
         Block* blk = block();
-        ProcedureDecl* procDecl = new ProcedureDecl(procName, blk);
+        ProcedureDecl* procDecl = make<ProcedureDecl>(procName, blk);
+        procDecl->offset_ = offset;
         decls.push_back(procDecl);
         eat(TokenType::Semi);
     }
@@ -399,12 +1051,12 @@ std::list<VarDecl*> Parser::variableDeclaration() {
     std::list<Var*> varNodes;
 
     // first ID
-    varNodes.push_back(new Var(currentToken_));
+    varNodes.push_back(make<Var>(*currentToken_));
     eat(TokenType::ID);
 
-    while (currentToken_.type_ == TokenType::Comma) {
+    while (currentToken_->type_ == TokenType::Comma) {
         eat(TokenType::Comma);
-        varNodes.push_back(new Var(currentToken_));
+        varNodes.push_back(make<Var>(*currentToken_));
         eat(TokenType::ID);
     }
     eat(TokenType::Colon);
@@ -413,30 +1065,211 @@ std::list<VarDecl*> Parser::variableDeclaration() {
 
     std::list<VarDecl*> varDeclarations;
     for (auto* varNode : varNodes) {
-        varDeclarations.emplace_back(new VarDecl(varNode, typeNode));
+        varDeclarations.emplace_back(make<VarDecl>(varNode, typeNode));
+        varDeclarations.back()->offset_ = varNode->offset_;
     }
 
     return varDeclarations;
 }
 
 Type* Parser::typeSpec() {
-    if (currentToken_.type_ == TokenType::Integer) {
+    Token token = *currentToken_;
+    if (currentToken_->type_ == TokenType::Integer) {
         eat(TokenType::Integer);
     } else {
         eat(TokenType::Real);
     }
 
-    return new Type(currentToken_);
+    return make<Type>(token);
+}
+
+/*
+* Sort by name, the hash table order is not stable across runs with different atoms.
+*/
+static bool nameLess(Atom lhs, Atom rhs) {
+    return Interner::name(lhs) < Interner::name(rhs);
+}
+
+ProcedureScanner::Word ProcedureScanner::next() {
+    while (pos_ < size_) {
+        char c = text_[pos_];
+        if (std::isspace(c)) {
+            pos_++;
+        } else if (c == '{') {
+            while (pos_ < size_ && text_[pos_] != '}') {
+                pos_++;
+            }
+            pos_++;
+        } else if (std::isalpha(c)) {
+            wordBegin_ = pos_;
+            while (pos_ < size_ && std::isalnum(text_[pos_])) {
+                pos_++;
+            }
+            std::string_view word(text_ + wordBegin_, pos_ - wordBegin_);
+            if (word == "PROCEDURE") {
+                return Word::Procedure;
+            } else if (word == "BEGIN") {
+                return Word::Begin;
+            } else if (word == "END") {
+                return Word::End;
+            }
+            return Word::Other;
+        } else if (c == ';') {
+            wordBegin_ = pos_++;
+            return Word::Semi;
+        } else {
+            // numbers, operators and ':=' don't matter for the nesting
+            wordBegin_ = pos_++;
+            return Word::Other;
+        }
+    }
+    return Word::Eof;
+}
+
+std::vector<ProcedureExtent> ProcedureScanner::scan() {
+    std::vector<ProcedureExtent> extents;
+    size_t openProcedures = 0;
+    size_t depth = 0;
+    ProcedureExtent current{};
+
+    for (Word word = next(); word != Word::Eof; word = next()) {
+        if (word == Word::Procedure) {
+            if (openProcedures == 0) {
+                current.declBegin = wordBegin_;
+                if (next() != Word::Other) {
+                    break;
+                }
+                current.name = Interner::intern(std::string_view(text_ + wordBegin_, pos_ - wordBegin_));
+                if (next() != Word::Semi) {
+                    break;
+                }
+                current.blockBegin = pos_;
+            }
+            openProcedures++;
+        } else if (word == Word::Begin) {
+            if (openProcedures == 0 && depth == 0) {
+                // the main compound statement
+                return extents;
+            }
+            depth++;
+        } else if (word == Word::End && depth > 0) {
+            depth--;
+            if (depth == 0 && openProcedures > 0 && --openProcedures == 0) {
+                current.blockEnd = pos_;
+                if (next() != Word::Semi) {
+                    break;
+                }
+                current.declEnd = pos_;
+                extents.push_back(current);
+            }
+        }
+    }
+    // malformed, let the regular parser report it
+    return {};
+}
+
+Program* ParallelParser::parse() {
+    std::vector<ProcedureExtent> extents = ProcedureScanner(text_.data(), text_.size()).scan();
+
+    std::vector<ProcedureDecl*> procedures(extents.size());
+    std::vector<std::exception_ptr> errors(extents.size());
+    TaskGroup group(pool_);
+    for (size_t i = 0; i < extents.size(); i++) {
+        arenas_.push_back(std::make_unique<Arena>());
+        Arena* arena = arenas_.back().get();
+        group.run([this, i, arena, &extents, &procedures, &errors] {
+            const ProcedureExtent& extent = extents[i];
+            try {
+                std::unique_ptr<Lexer> lexer = std::make_unique<Lexer>(
+                        text_.data() + extent.blockBegin, extent.blockEnd - extent.blockBegin);
+                lexer->setOffset(extent.blockBegin);
+                Parser parser(std::move(lexer), false, arena);
+                Block* blk = parser.parseBlock();
+                procedures[i] = arena->make<ProcedureDecl>(extent.name, blk);
+                procedures[i]->offset_ = extent.declBegin;
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+
+    // the rest of the program, offsets stay those of the original text
+    std::string skeleton = text_;
+    for (const ProcedureExtent& extent : extents) {
+        memset(&skeleton[extent.declBegin], ' ', extent.declEnd - extent.declBegin);
+    }
+    arenas_.push_back(std::make_unique<Arena>());
+    Parser parser(std::make_unique<Lexer>(std::move(skeleton)), false, arenas_.back().get());
+    Program* prog = static_cast<Program*>(parser.parse());
+
+    group.wait();
+    for (std::exception_ptr& error : errors) {
+        if (error != nullptr) {
+            std::rethrow_exception(error);
+        }
+    }
+    for (ProcedureDecl* procedure : procedures) {
+        prog->block_->declarations_.push_back(procedure);
+    }
+    return prog;
+}
+
+Program* LazyParser::parse() {
+    std::vector<ProcedureExtent> extents = ProcedureScanner(text_.data(), text_.size()).scan();
+
+    std::string skeleton = text_;
+    for (const ProcedureExtent& extent : extents) {
+        memset(&skeleton[extent.declBegin], ' ', extent.declEnd - extent.declBegin);
+    }
+    Parser parser(std::make_unique<Lexer>(std::move(skeleton)), false, &arena_);
+    Program* prog = static_cast<Program*>(parser.parse());
+
+    for (const ProcedureExtent& extent : extents) {
+        blocks_.push_back(std::make_unique<LazyBlock>(
+                text_.data() + extent.blockBegin, extent.blockEnd - extent.blockBegin, extent.blockBegin));
+        ProcedureDecl* procedure = arena_.make<ProcedureDecl>(extent.name, blocks_.back().get());
+        procedure->offset_ = extent.declBegin;
+        prog->block_->declarations_.push_back(procedure);
+    }
+    return prog;
+}
+
+Block* ProcedureDecl::parseLazily() {
+    // a failed attempt leaves the flag unset, the next call reports the error again
+    std::call_once(lazy_->once, [this] {
+        std::unique_ptr<Lexer> lexer = std::make_unique<Lexer>(lazy_->text, lazy_->size);
+        lexer->setOffset(lazy_->offset);
+        Parser parser(std::move(lexer), false, &lazy_->arena);
+        Block* blk = parser.parseBlock();
+        if (lazy_->checker != nullptr) {
+            blk->accept(*lazy_->checker);
+            const std::vector<Diagnostic>& diagnostics = lazy_->checker->diagnostics();
+            if (!diagnostics.empty()) {
+                throw SourceError(diagnostics.front().offset, diagnostics.front().message);
+            }
+        }
+        blk_ = blk;
+        lazy_->parsed.store(true, std::memory_order_release);
+    });
+    return blk_;
 }
 
 std::string SymbolTable::getPrettyPrintedString() {
+    std::vector<Symbol*> symbols;
+    symbols_.forEach([&symbols](Atom name, Symbol* symbol) {
+        symbols.push_back(symbol);
+    });
+    std::sort(symbols.begin(), symbols.end(), [](Symbol* lhs, Symbol* rhs) {
+        return nameLess(lhs->name_, rhs->name_);
+    });
+
     std::string ans;
     ans = "Symbols: {";
-    auto iter = symbols_.begin();
-    while (iter != symbols_.end()) {
-        ans += iter->second->getPrettyPrintedString();
+    auto iter = symbols.begin();
+    while (iter != symbols.end()) {
+        ans += (*iter)->getPrettyPrintedString();
         iter++;
-        if (iter != symbols_.end()) {
+        if (iter != symbols.end()) {
             ans += ",";
         }
     }
@@ -445,14 +1278,20 @@ std::string SymbolTable::getPrettyPrintedString() {
 }
 
 void SymbolTable::define(Symbol* symbol) {
-    printf("Define: %s", symbol->getPrettyPrintedString().c_str());
     symbols_[symbol->name_] = symbol;
 }
 
-Symbol* SymbolTable::lookup(std::string& name) {
-    printf("Lookup: %s", name.c_str());
-    Symbol* symbol = symbols_[name];
-    return symbol;
+Symbol* SymbolTable::lookup(Atom name, bool currentScopeOnly) {
+    for (SymbolTable* scope = this; scope != nullptr; scope = scope->enclosing_) {
+        Symbol** symbol = scope->symbols_.find(name);
+        if (symbol != nullptr) {
+            return *symbol;
+        }
+        if (currentScopeOnly) {
+            break;
+        }
+    }
+    return nullptr;
 }
 
 void SymbolTable::initBuiltins() {
@@ -465,22 +1304,94 @@ void Interpreter::visit(Program& prog) {
 }
 
 void SymbolTableBuilder::visit(Block& blk) {
+    size_t firstProcedure = pendingProcedures_.size();
     for (AST* declaration : blk.declarations_) {
         declaration->accept(*this);
     }
+    std::vector<ProcedureDecl*> procedures(pendingProcedures_.begin() + firstProcedure, pendingProcedures_.end());
+    pendingProcedures_.resize(firstProcedure);
+
+    analyzeProcedures(procedures);
     blk.compoundStatement_->accept(*this);
 }
 
 void SymbolTableBuilder::visit(Program& prog) {
+    scope_ = std::make_unique<SymbolTable>(prog.name_);
+    symtab = scope_.get();
     prog.block_->accept(*this);
 }
 
-void SymbolTableBuilder::visit(BinOp& bo) {
-    bo.left_->accept(*this);
-    bo.right_->accept(*this);
+void SymbolTableBuilder::visit(ProcedureDecl& pd) {
+    symtab->define(new ProcedureSymbol(pd.name_));
+    pendingProcedures_.push_back(&pd);
+}
+
+void SymbolTableBuilder::analyzeProcedures(const std::vector<ProcedureDecl*>& procedures) {
+    size_t first = bodies_.size();
+    for (ProcedureDecl* pd : procedures) {
+        auto scope = std::make_unique<SymbolTable>(pd->name_, symtab->scopeLevel() + 1, symtab);
+        bodies_.emplace_back(new SymbolTableBuilder(pool_, deferLazyBodies_, std::move(scope)));
+    }
+
+    // the scope of a deferred body stays with its builder until the first call
+    std::vector<ProcedureDecl*> now(procedures);
+    if (deferLazyBodies_) {
+        for (size_t i = 0; i < now.size(); i++) {
+            if (!now[i]->isParsed()) {
+                now[i]->deferCheck(bodies_[first + i].get());
+                now[i] = nullptr;
+            }
+        }
+    }
+
+    if (pool_ != nullptr && now.size() > 1) {
+        TaskGroup group(*pool_);
+        for (size_t i = 0; i < now.size(); i++) {
+            SymbolTableBuilder* body = bodies_[first + i].get();
+            ProcedureDecl* pd = now[i];
+            if (pd != nullptr) {
+                group.run([body, pd] {
+                    pd->body()->accept(*body);
+                });
+            }
+        }
+        group.wait();
+    } else {
+        for (size_t i = 0; i < now.size(); i++) {
+            if (now[i] != nullptr) {
+                now[i]->body()->accept(*bodies_[first + i]);
+            }
+        }
+    }
+
+    for (size_t i = first; i < bodies_.size(); i++) {
+        const std::vector<Diagnostic>& diagnostics = bodies_[i]->diagnostics_;
+        diagnostics_.insert(diagnostics_.end(), diagnostics.begin(), diagnostics.end());
+    }
+}
+
+void SymbolTableBuilder::visit(ProcedureCall& pc) {
+    if (symtab->lookup(pc.procName_) == nullptr) {
+        error(pc.offset_, "procedure " + Interner::name(pc.procName_) + " not declared");
+    }
+}
+
+void SymbolTableBuilder::visit(BinOp& bo) {
+    ExpressionDepth depth;
+    if (depth.exceeded()) {
+        walkExpression(bo, [this](AST& leaf) { leaf.accept(*this); }, [](UnaryOp&) {}, [](BinOp&) {});
+        return;
+    }
+    bo.left_->accept(*this);
+    bo.right_->accept(*this);
 }
 
 void SymbolTableBuilder::visit(UnaryOp& uo) {
+    ExpressionDepth depth;
+    if (depth.exceeded()) {
+        walkExpression(uo, [this](AST& leaf) { leaf.accept(*this); }, [](UnaryOp&) {}, [](BinOp&) {});
+        return;
+    }
     uo.expr_->accept(*this);
 }
 
@@ -490,31 +1401,50 @@ void SymbolTableBuilder::visit(Compound& comp) {
     }
 }
 
+void SymbolTableBuilder::visit(While& loop) {
+    loop.condition_->accept(*this);
+    loop.body_->accept(*this);
+}
+
+void SymbolTableBuilder::visit(For& loop) {
+    Atom name = loop.variable_->value_;
+    loop.variable_->accept(*this);
+    if (std::find(controls_.begin(), controls_.end(), name) != controls_.end()) {
+        error(loop.variable_->offset_, "FOR variable " + Interner::name(name) + " already in use");
+    }
+    loop.from_->accept(*this);
+    loop.to_->accept(*this);
+    controls_.push_back(name);
+    loop.body_->accept(*this);
+    controls_.pop_back();
+}
+
 void SymbolTableBuilder::visit(VarDecl& vDecl) {
-    std::string& name = vDecl.typeNode_->value_;
-    Symbol* typeSymbol = symtab.lookup(name);
-    std::string& varName = vDecl.varNode_->value_;
+    Atom name = vDecl.typeNode_->value_;
+    Symbol* typeSymbol = symtab->lookup(name);
+    Atom varName = vDecl.varNode_->value_;
     // 下面的强转只是基于当前的type只有builtin的情况下成立
     VarSymbol* varSymbol = new VarSymbol(varName, static_cast<BuiltinTypeSymbol*>(typeSymbol));
-    symtab.define(varSymbol);
+    symtab->define(varSymbol);
 }
 
 void SymbolTableBuilder::visit(Assign& as) {
-    std::string& name = as.left_->value_;
-    Symbol* varSymbol = symtab.lookup(name);
+    Atom name = as.left_->value_;
+    Symbol* varSymbol = symtab->lookup(name);
     if (varSymbol == nullptr) {
-        std::string str = "variable " + name + "not declared";
-        throw std::runtime_error(str);
+        error(as.left_->offset_, "variable " + Interner::name(name) + " not declared");
+    }
+    if (std::find(controls_.begin(), controls_.end(), name) != controls_.end()) {
+        error(as.left_->offset_, "cannot assign to FOR variable " + Interner::name(name));
     }
     as.right_->accept(*this);
 }
 
 void SymbolTableBuilder::visit(Var& var) {
-    std::string& name = var.value_;
-    Symbol* varSymbol = symtab.lookup(name);
+    Atom name = var.value_;
+    Symbol* varSymbol = symtab->lookup(name);
     if (varSymbol == nullptr) {
-        std::string str = "variable " + name + "not declared";
-        throw std::runtime_error(str);
+        error(var.offset_, "variable " + Interner::name(name) + " not declared");
     }
 }
 
@@ -533,30 +1463,83 @@ void Interpreter::visit(Type& tp) {
     // Do nothig
 }
 
-int Interpreter::visit(BinOp& bo) {
-    if (bo.op_.type_ == TokenType::PLUS) {
-        return bo.left_->accept(*this) + bo.right_->accept(*this);
-    }
-    if (bo.op_.type_ == TokenType::MINUS) {
-        return bo.left_->accept(*this) - bo.right_->accept(*this);
+/*
+* DIV by zero and INT_MIN DIV -1 raise SIGFPE, which no handler can turn
+* back into an error of the one program. They are checked here instead.
+*/
+static int checkedDivide(int left, int right, uint32_t offset) {
+    if (right == 0) {
+        throw SourceError(offset, "division by zero");
     }
-    if (bo.op_.type_ == TokenType::MUL) {
-        return bo.left_->accept(*this) * bo.right_->accept(*this);
+    if (right == -1 && left == INT32_MIN) {
+        throw SourceError(offset, "division overflow");
     }
-    if (bo.op_.type_ == TokenType::IntegerDiv) {
-        return bo.left_->accept(*this) / bo.right_->accept(*this);
+    return left / right;
+}
+
+// offset is the operator's, for the error of a failing DIV
+static int applyBinary(TokenType op, int left, int right, uint32_t offset) {
+    switch (op) {
+    case TokenType::PLUS:
+        return left + right;
+    case TokenType::MINUS:
+        return left - right;
+    case TokenType::MUL:
+        return left * right;
+    case TokenType::IntegerDiv:
+        return checkedDivide(left, right, offset);
+    case TokenType::FloatDiv:
+        return (float)left / (float)right;
+    case TokenType::Equal:
+        return left == right;
+    case TokenType::NotEqual:
+        return left != right;
+    case TokenType::Less:
+        return left < right;
+    case TokenType::LessEqual:
+        return left <= right;
+    case TokenType::Greater:
+        return left > right;
+    case TokenType::GreaterEqual:
+        return left >= right;
+    default:
+        throw std::runtime_error("unknown binary operator");
     }
-    if (bo.op_.type_ == TokenType::FloatDiv) {
-        return (float)(bo.left_->accept(*this)) / (float)(bo.right_->accept(*this));
+}
+
+int Interpreter::visit(BinOp& bo) {
+    ExpressionDepth depth;
+    if (depth.exceeded()) {
+        return evaluateIteratively(bo);
     }
+    int left = bo.left_->accept(*this);
+    int right = bo.right_->accept(*this);
+    return applyBinary(bo.op_.type_, left, right, bo.op_.offset_);
 }
 
 int Interpreter::visit(UnaryOp& uo) {
-    if (uo.op_.type_ == TokenType::PLUS) {
-        return uo.expr_->accept(*this);
-    } else if (uo.op_.type_ == TokenType::MINUS) {
-        return -uo.expr_->accept(*this);
+    ExpressionDepth depth;
+    if (depth.exceeded()) {
+        return evaluateIteratively(uo);
     }
+    int value = uo.expr_->accept(*this);
+    return uo.op_.type_ == TokenType::MINUS ? -value : value;
+}
+
+int Interpreter::evaluateIteratively(AST& expr) {
+    std::vector<int> values;
+    walkExpression(expr, [this, &values](AST& leaf) {
+        values.push_back(leaf.accept(*this));
+    }, [&values](UnaryOp& uo) {
+        if (uo.op_.type_ == TokenType::MINUS) {
+            values.back() = -values.back();
+        }
+    }, [&values](BinOp& bo) {
+        int right = values.back();
+        values.pop_back();
+        values.back() = applyBinary(bo.op_.type_, values.back(), right, bo.op_.offset_);
+    });
+    return values.back();
 }
 
 int Interpreter::visit(Num& num) {
@@ -564,65 +1547,3958 @@ int Interpreter::visit(Num& num) {
 }
 
 void Interpreter::visit(Compound& comp) {
+    StatementDepth depth;
+    uint64_t size = comp.children_.size();
+    if (steps_.fetch_add(size, std::memory_order_relaxed) + size > nextCheck_.load(std::memory_order_relaxed)) {
+        // a check is due inside the block, charge it a statement at a time
+        // so that an abort names the statement that did not run
+        steps_.fetch_sub(size, std::memory_order_relaxed);
+        for (AST* child : comp.children_) {
+            charge(1, child);
+            child->accept(*this);
+        }
+        return;
+    }
+    if (pool_ != nullptr && !inParallelRegion_ && comp.children_.size() >= PARALLEL_MIN_STATEMENTS) {
+        runParallel(comp);
+        return;
+    }
+    for (AST* child : comp.children_) {
+        child->accept(*this);
+    }
+}
+
+int AccessCollector::visit(BinOp& bo) {
+    ExpressionDepth depth;
+    if (depth.exceeded()) {
+        walkExpression(bo, [this](AST& leaf) { leaf.accept(*this); }, [](UnaryOp&) {}, [](BinOp&) {});
+        return 0;
+    }
+    bo.left_->accept(*this);
+    bo.right_->accept(*this);
+    return 0;
+}
+
+int AccessCollector::visit(UnaryOp& uo) {
+    ExpressionDepth depth;
+    if (depth.exceeded()) {
+        walkExpression(uo, [this](AST& leaf) { leaf.accept(*this); }, [](UnaryOp&) {}, [](BinOp&) {});
+        return 0;
+    }
+    uo.expr_->accept(*this);
+    return 0;
+}
+
+void AccessCollector::visit(Compound& comp) {
     for (AST* child : comp.children_) {
         child->accept(*this);
     }
 }
 
+void AccessCollector::visit(Assign& as) {
+    as.right_->accept(*this);
+    writes_.push_back(as.left_->value_);
+}
+
+int AccessCollector::visit(Var& var) {
+    reads_.push_back(var.value_);
+    return 0;
+}
+
+std::unique_ptr<StatementSchedule> StatementSchedule::build(Compound& comp) {
+    auto schedule = std::make_unique<StatementSchedule>();
+    // level + 1 of the last write and of the latest read since then, 0 for none
+    AtomMap<int> writeLevel;
+    AtomMap<int> readLevel;
+    Segment* segment = nullptr;
+
+    for (AST* child : comp.children_) {
+        AccessCollector access;
+        child->accept(access);
+
+        if (access.barrier_) {
+            schedule->segments.emplace_back();
+            schedule->segments.back().statements.push_back(child);
+            schedule->segments.back().barrier = true;
+            segment = nullptr;
+            continue;
+        }
+        if (segment == nullptr) {
+            schedule->segments.emplace_back();
+            segment = &schedule->segments.back();
+            writeLevel = AtomMap<int>();
+            readLevel = AtomMap<int>();
+        }
+
+        int level = 0;
+        for (Atom var : access.reads_) {
+            level = std::max(level, writeLevel[var]);
+        }
+        for (Atom var : access.writes_) {
+            level = std::max(level, std::max(writeLevel[var], readLevel[var]));
+        }
+        for (Atom var : access.writes_) {
+            writeLevel[var] = level + 1;
+            readLevel[var] = 0;
+        }
+        for (Atom var : access.reads_) {
+            readLevel[var] = std::max(readLevel[var], level + 1);
+        }
+
+        if (segment->levels.size() <= static_cast<size_t>(level)) {
+            segment->levels.resize(level + 1);
+        }
+        segment->levels[level].push_back(child);
+        segment->statements.push_back(child);
+        segment->reads.push_back(std::move(access.reads_));
+        segment->writes.push_back(std::move(access.writes_));
+    }
+    return schedule;
+}
+
+void Interpreter::runParallel(Compound& comp) {
+    std::unique_ptr<StatementSchedule>& schedule = schedules_[&comp];
+    if (schedule == nullptr) {
+        schedule = StatementSchedule::build(comp);
+    }
+    for (StatementSchedule::Segment& segment : schedule->segments) {
+        if (segment.barrier || segment.statements.size() < PARALLEL_MIN_STATEMENTS) {
+            for (AST* statement : segment.statements) {
+                statement->accept(*this);
+            }
+        } else {
+            runSegment(segment);
+        }
+    }
+}
+
+void Interpreter::runSegment(StatementSchedule::Segment& segment) {
+    // a read before any write must fail exactly as in serial order, leave that to the serial path
+    AtomMap<bool> defined;
+    for (size_t i = 0; i < segment.statements.size(); i++) {
+        for (Atom var : segment.reads[i]) {
+            if (GLOBAL_SCOPE.find(var) == nullptr && defined.find(var) == nullptr) {
+                for (AST* statement : segment.statements) {
+                    statement->accept(*this);
+                }
+                return;
+            }
+        }
+        for (Atom var : segment.writes[i]) {
+            defined[var] = true;
+        }
+    }
+
+    // from here on GLOBAL_SCOPE is only updated in place, never rehashed
+    for (const std::vector<Atom>& writes : segment.writes) {
+        for (Atom var : writes) {
+            GLOBAL_SCOPE[var];
+        }
+    }
+
+    inParallelRegion_ = true;
+    try {
+        for (std::vector<AST*>& level : segment.levels) {
+            size_t chunk = std::max(PARALLEL_MIN_CHUNK, (level.size() + pool_->size() - 1) / pool_->size());
+            if (level.size() <= chunk) {
+                for (AST* statement : level) {
+                    statement->accept(*this);
+                }
+                continue;
+            }
+            TaskGroup group(*pool_);
+            for (size_t begin = 0; begin < level.size(); begin += chunk) {
+                size_t end = std::min(level.size(), begin + chunk);
+                group.run([this, &level, begin, end] {
+                    for (size_t i = begin; i < end; i++) {
+                        level[i]->accept(*this);
+                    }
+                });
+            }
+            group.wait();
+        }
+    } catch (...) {
+        inParallelRegion_ = false;
+        throw;
+    }
+    inParallelRegion_ = false;
+}
+
+ExecutionAborted::ExecutionAborted(Reason reason, uint64_t steps, const std::string& statement, uint32_t offset)
+    : SourceError(offset, std::string("Execution aborted, ") +
+                  (reason == Reason::CallDepth ? std::string("calls nested too deeply")
+                   : (reason == Reason::StepBudget ? "step budget" : "deadline") + std::string(" exceeded after ") +
+                     std::to_string(steps) + " steps") + " at " + statement),
+      reason_(reason), steps_(steps), statement_(statement) {}
+
+// the profiler that owns the SIGPROF timer
+static std::atomic<Profiler*> activeProfiler{nullptr};
+
+Profiler::Profiler(Mode mode, std::chrono::microseconds interval) : mode_(mode), interval_(interval) {
+    static_assert(std::atomic<uint32_t>::is_always_lock_free, "frames are read in a signal handler");
+}
+
+Profiler::~Profiler() {
+    stop();
+}
+
+void Profiler::start(Atom program) {
+    root_.procedure = program;
+    frames_[0].procedure.store(program, std::memory_order_relaxed);
+    frames_[0].offset.store(0, std::memory_order_relaxed);
+    depth_.store(1, std::memory_order_relaxed);
+    if (mode_ != Mode::Sample) {
+        return;
+    }
+
+    samples_.resize(SAMPLE_BUFFER_WORDS);
+    Profiler* expected = nullptr;
+    if (!activeProfiler.compare_exchange_strong(expected, this)) {
+        throw std::runtime_error("Another profiler is already sampling");
+    }
+    struct sigaction action{};
+    action.sa_handler = &Profiler::onSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+
+    itimerval timer{};
+    timer.it_interval.tv_sec = interval_.count() / 1000000;
+    timer.it_interval.tv_usec = interval_.count() % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    running_ = true;
+}
+
+void Profiler::stop() {
+    if (!running_) {
+        return;
+    }
+    itimerval timer{};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    signal(SIGPROF, SIG_IGN);
+    activeProfiler.store(nullptr);
+    running_ = false;
+}
+
+void Profiler::onSignal(int) {
+    Profiler* profiler = activeProfiler.load(std::memory_order_relaxed);
+    if (profiler != nullptr) {
+        profiler->takeSample();
+    }
+}
+
+void Profiler::takeSample() {
+    // signal handler: no allocation, no locks
+    uint32_t depth = depth_.load(std::memory_order_relaxed);
+    size_t words = 1 + 2 * depth;
+    // claimed before they are written, so no two samples share words
+    size_t at = sampleWords_.load(std::memory_order_relaxed);
+    do {
+        if (at + words > samples_.size()) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+    } while (!sampleWords_.compare_exchange_weak(at, at + words, std::memory_order_relaxed));
+    samples_[at++] = depth;
+    for (uint32_t i = 0; i < depth; i++) {
+        samples_[at++] = frames_[i].procedure.load(std::memory_order_relaxed);
+        samples_[at++] = frames_[i].offset.load(std::memory_order_relaxed);
+    }
+}
+
+void Profiler::enter(Atom procedure) {
+    uint32_t depth = depth_.load(std::memory_order_relaxed);
+    if (depth == MAX_DEPTH) {
+        hiddenFrames_++;
+        return;
+    }
+    if (mode_ == Mode::Count) {
+        uint32_t callOffset = frames_[depth - 1].offset.load(std::memory_order_relaxed);
+        std::unique_ptr<Context>& child = context_->children[{callOffset, procedure}];
+        if (child == nullptr) {
+            child = std::make_unique<Context>();
+            child->parent = context_;
+            child->procedure = procedure;
+            child->callOffset = callOffset;
+        }
+        context_ = child.get();
+    }
+    frames_[depth].procedure.store(procedure, std::memory_order_relaxed);
+    frames_[depth].offset.store(0, std::memory_order_relaxed);
+    depth_.store(depth + 1, std::memory_order_relaxed);
+}
+
+void Profiler::leave() {
+    if (hiddenFrames_ > 0) {
+        hiddenFrames_--;
+        return;
+    }
+    if (mode_ == Mode::Count) {
+        context_ = context_->parent;
+    }
+    depth_.store(depth_.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+}
+
+void Profiler::foldContext(const Context& context, const std::string& prefix, const SourceMap& source,
+                           std::map<std::string, uint64_t>& stacks) {
+    std::string name = Interner::name(context.procedure);
+    for (const auto& count : context.counts) {
+        stacks[prefix + name + ":" + std::to_string(source.locate(count.first).line)] += count.second;
+    }
+    for (const auto& child : context.children) {
+        std::string frame = name + ":" + std::to_string(source.locate(child.first.first).line) + ";";
+        foldContext(*child.second, prefix + frame, source, stacks);
+    }
+}
+
+void Profiler::writeFolded(std::ostream& out, const SourceMap& source) {
+    // statements on one line, or calls from one line, fold into one stack
+    std::map<std::string, uint64_t> stacks;
+    if (mode_ == Mode::Count) {
+        foldContext(root_, "", source, stacks);
+    }
+    for (size_t pos = 0; mode_ == Mode::Sample && pos < sampleWords_.load(); ) {
+        uint32_t depth = samples_[pos++];
+        std::string stack;
+        for (uint32_t i = 0; i < depth; i++, pos += 2) {
+            stack += (i == 0 ? "" : ";") + Interner::name(samples_[pos]) + ":" +
+                     std::to_string(source.locate(samples_[pos + 1]).line);
+        }
+        stacks[stack]++;
+    }
+    for (const auto& stack : stacks) {
+        out << stack.first << " " << stack.second << "\n";
+    }
+}
+
+void ProfilingInterpreter::visit(Program& prog) {
+    profiler_.start(prog.name_);
+    try {
+        Interpreter::visit(prog);
+    } catch (...) {
+        profiler_.stop();
+        throw;
+    }
+    profiler_.stop();
+}
+
+void ProfilingInterpreter::visit(Assign& as) {
+    profiler_.statement(as.offset_);
+    Interpreter::visit(as);
+}
+
+void ProfilingInterpreter::visit(NoOp& noop) {
+    profiler_.statement(noop.offset_);
+}
+
+void ProfilingInterpreter::visit(ProcedureCall& pc) {
+    profiler_.statement(pc.offset_);
+    profiler_.enter(pc.procName_);
+    Interpreter::visit(pc);
+    profiler_.leave();
+}
+
+void ProfilingInterpreter::visit(While& loop) {
+    profiler_.statement(loop.offset_);
+    Interpreter::visit(loop);
+}
+
+void ProfilingInterpreter::visit(For& loop) {
+    profiler_.statement(loop.offset_);
+    Interpreter::visit(loop);
+}
+
+/*
+* Short description of a statement for diagnostics.
+*/
+static std::string describeStatement(AST* statement) {
+    struct Describer : public NodeVisitor {
+        void visit(Compound& comp) override {
+            text = "compound statement";
+        }
+        void visit(Assign& as) override {
+            text = "assignment to " + Interner::name(as.left_->value_);
+        }
+        void visit(NoOp& noop) override {
+            text = "empty statement";
+        }
+        void visit(ProcedureCall& pc) override {
+            text = "call of " + Interner::name(pc.procName_);
+        }
+        void visit(While& loop) override {
+            text = "WHILE loop";
+        }
+        void visit(For& loop) override {
+            text = "FOR loop over " + Interner::name(loop.variable_->value_);
+        }
+        std::string text = "statement";
+    } describer;
+    statement->accept(describer);
+    return describer.text;
+}
+
+void Interpreter::setLimits(const ExecutionLimits& limits) {
+    maxSteps_ = limits.maxSteps;
+    maxDepth_ = std::min(limits.maxDepth, StatementDepth::MAX_NATIVE_DEPTH);
+    hasDeadline_ = limits.timeout.count() > 0;
+    deadline_ = std::chrono::steady_clock::now() + limits.timeout;
+    uint64_t now = steps_.load(std::memory_order_relaxed);
+    nextCheck_ = hasDeadline_ ? std::min(maxSteps_, now + DEADLINE_CHECK_STEPS) : maxSteps_;
+}
+
+void Interpreter::checkLimits(uint64_t total, AST* statement) {
+    if (total > maxSteps_) {
+        throw ExecutionAborted(ExecutionAborted::Reason::StepBudget, total, describeStatement(statement),
+                               statement->offset_);
+    }
+    if (hasDeadline_) {
+        if (std::chrono::steady_clock::now() >= deadline_) {
+            throw ExecutionAborted(ExecutionAborted::Reason::Deadline, total, describeStatement(statement),
+                                   statement->offset_);
+        }
+        nextCheck_.store(std::min(maxSteps_, total + DEADLINE_CHECK_STEPS), std::memory_order_relaxed);
+    }
+}
+
 void Interpreter::visit(NoOp& noop) {
 
 }
 
+void Interpreter::visit(ProcedureDecl& pd) {
+    PROCEDURES[pd.name_] = &pd;
+}
+
+void Interpreter::visit(ProcedureCall& pc) {
+    ProcedureDecl** pd = PROCEDURES.find(pc.procName_);
+    if (pd == nullptr) {
+        throw std::runtime_error("procedure " + Interner::name(pc.procName_) + " not defined");
+    }
+    statementsExecuted_.fetch_add(1, std::memory_order_relaxed);
+    charge(1, &pc);
+    StatementDepth depth;
+    if (depth.depth() > maxDepth_) {
+        throw ExecutionAborted(ExecutionAborted::Reason::CallDepth, steps(), describeStatement(&pc), pc.offset_);
+    }
+    (*pd)->body()->accept(*this);
+}
+
+void Interpreter::visit(While& loop) {
+    StatementDepth depth;
+    for (;;) {
+        charge(1, &loop);
+        if (loop.condition_->accept(*this) == 0) {
+            return;
+        }
+        loop.body_->accept(*this);
+        if (osrThreshold_ != NO_OSR
+                && loop.backEdges_.fetch_add(1, std::memory_order_relaxed) + 1 >= osrThreshold_) {
+            execute(loop.compiled(peephole_));
+            return;
+        }
+    }
+}
+
+void Interpreter::visit(For& loop) {
+    StatementDepth depth;
+    int counter = loop.from_->accept(*this);
+    int last = loop.to_->accept(*this);
+    Atom name = loop.variable_->value_;
+    for (bool done = counter > last; ; ) {
+        charge(1, &loop);
+        if (done) {
+            return;
+        }
+        GLOBAL_SCOPE[name] = counter;
+        loop.body_->accept(*this);
+        done = counter == last;
+        if (done) {
+            continue;
+        }
+        counter++;
+        if (osrThreshold_ != NO_OSR
+                && loop.backEdges_.fetch_add(1, std::memory_order_relaxed) + 1 >= osrThreshold_) {
+            execute(loop.compiled(peephole_), {counter, last});
+            return;
+        }
+    }
+}
+
 void Interpreter::visit(Assign& as) {
-    std::string varName = as.left_->value_;
+    statementsExecuted_.fetch_add(1, std::memory_order_relaxed);
+    Atom varName = as.left_->value_;
     GLOBAL_SCOPE[varName] = as.right_->accept(*this);
 }
 
 int Interpreter::visit(Var& var) {
-    std::string varName = var.value_;
-    auto it = GLOBAL_SCOPE.find(varName);
-    if (it == GLOBAL_SCOPE.end()) {
+    Atom varName = var.value_;
+    int* value = GLOBAL_SCOPE.find(varName);
+    if (value == nullptr) {
         throw std::runtime_error("variable not defined");
     }
 
-    return it->second;
+    return *value;
 }
 
-void Interpreter::printGlobalScope() {
-    std::cout << "{";
-    auto iter = GLOBAL_SCOPE.begin();
-    while (iter != GLOBAL_SCOPE.end()) {
-        std::cout << iter->first << ": " << iter->second;
+void Interpreter::printGlobalScope(std::ostream& out, const std::vector<Atom>& only) {
+    std::vector<std::pair<Atom, int>> vars;
+    GLOBAL_SCOPE.forEach([&vars, &only](Atom name, int value) {
+        if (!CommonSubexpressions::isTemporary(name)
+                && (only.empty() || std::find(only.begin(), only.end(), name) != only.end())) {
+            vars.emplace_back(name, value);
+        }
+    });
+    std::sort(vars.begin(), vars.end(), [](const std::pair<Atom, int>& lhs, const std::pair<Atom, int>& rhs) {
+        return nameLess(lhs.first, rhs.first);
+    });
+
+    out << "{";
+    auto iter = vars.begin();
+    while (iter != vars.end()) {
+        out << Interner::name(iter->first) << ": " << iter->second;
         iter++;
-        if (iter != GLOBAL_SCOPE.end()) {
-            std::cout << ", ";
+        if (iter != vars.end()) {
+            out << ", ";
         }
     }
-    std::cout << "}";
-    std::cout << std::endl;
+    out << "}";
+    out << std::endl;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        std::cout << "please input your file" << std::endl;
+std::vector<LaneInterpreter::Scope> LaneInterpreter::run(AST* tree, const std::vector<Atom>& inputs,
+                                                        const std::vector<std::vector<int>>& rows) {
+    std::vector<Scope> scopes(rows.size());
+    for (size_t first = 0; first < rows.size(); first += LANES) {
+        size_t count = std::min(LANES, rows.size() - first);
+        scope_ = AtomMap<Lanes>();
+        procedures_ = AtomMap<ProcedureDecl*>();
+        for (size_t i = 0; i < inputs.size(); i++) {
+            Lanes values;
+            for (size_t lane = 0; lane < LANES; lane++) {
+                // spare lanes repeat the last instance and are dropped
+                values[lane] = rows[first + std::min(lane, count - 1)][i];
+            }
+            scope_[inputs[i]] = values;
+        }
+
+        tree->accept(*this);
+
+        // sort names only, moving whole lane vectors around is wasteful
+        std::vector<Atom> names;
+        scope_.forEach([&names](Atom name, const Lanes&) {
+            names.push_back(name);
+        });
+        std::sort(names.begin(), names.end(), nameLess);
+        for (Atom name : names) {
+            const Lanes& values = *scope_.find(name);
+            for (size_t lane = 0; lane < count; lane++) {
+                scopes[first + lane].emplace_back(name, values[lane]);
+            }
+        }
     }
-    const std::string filepath(argv[1]);
-    std::ifstream file(filepath);
+    return scopes;
+}
 
-    if (!file.is_open()) {
-        std::cerr << "Failed to open file: " << filepath << std::endl;
-        return 1;
+void LaneInterpreter::visit(Program& prog) {
+    prog.block_->accept(*this);
+}
+
+void LaneInterpreter::visit(Block& blk) {
+    for (AST* decl : blk.declarations_) {
+        decl->accept(*this);
+    }
+    blk.compoundStatement_->accept(*this);
+}
+
+void LaneInterpreter::visit(ProcedureDecl& pd) {
+    procedures_[pd.name_] = &pd;
+}
+
+void LaneInterpreter::visit(ProcedureCall& pc) {
+    ProcedureDecl** pd = procedures_.find(pc.procName_);
+    if (pd == nullptr) {
+        throw std::runtime_error("procedure " + Interner::name(pc.procName_) + " not defined");
+    }
+    StatementDepth depth;
+    if (depth.exceeded()) {
+        throw ExecutionAborted(ExecutionAborted::Reason::CallDepth, 0, describeStatement(&pc), pc.offset_);
+    }
+    (*pd)->body()->accept(*this);
+}
+
+void LaneInterpreter::visit(While& loop) {
+    StatementDepth depth;
+    for (;;) {
+        loop.condition_->accept(*this);
+        bool any = false;
+        bool all = true;
+        for (size_t lane = 0; lane < LANES; lane++) {
+            any |= result_[lane] != 0;
+            all &= result_[lane] != 0;
+        }
+        if (any != all) {
+            throw LanesDiverged(loop.offset_);
+        }
+        if (!all) {
+            return;
+        }
+        loop.body_->accept(*this);
     }
+}
 
-    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+int LaneInterpreter::uniform(AST& expr, uint32_t offset) {
+    expr.accept(*this);
+    for (size_t lane = 1; lane < LANES; lane++) {
+        if (result_[lane] != result_[0]) {
+            throw LanesDiverged(offset);
+        }
+    }
+    return result_[0];
+}
 
-    std::unique_ptr<Lexer> lexer = std::make_unique<Lexer>(std::move(content));
-    std::unique_ptr<Parser> parser = std::make_unique<Parser>(std::move(lexer));
-    Interpreter interp(std::move(parser));
-    interp.interpret();
-    interp.printGlobalScope();
+void LaneInterpreter::visit(For& loop) {
+    StatementDepth depth;
+    int counter = uniform(*loop.from_, loop.offset_);
+    int last = uniform(*loop.to_, loop.offset_);
+    if (counter > last) {
+        return;
+    }
+    for (;;) {
+        scope_[loop.variable_->value_] = Lanes{} + counter;
+        loop.body_->accept(*this);
+        if (counter == last) {
+            return;
+        }
+        counter++;
+    }
+}
+
+void LaneInterpreter::visit(Compound& comp) {
+    StatementDepth depth;
+    for (AST* child : comp.children_) {
+        child->accept(*this);
+    }
+}
+
+void LaneInterpreter::visit(Assign& as) {
+    as.right_->accept(*this);
+    scope_[as.left_->value_] = result_;
+}
+
+int LaneInterpreter::visit(Var& var) {
+    Lanes* values = scope_.find(var.value_);
+    if (values == nullptr) {
+        throw std::runtime_error("variable not defined");
+    }
+    result_ = *values;
+    return 0;
+}
+
+int LaneInterpreter::visit(Num& num) {
+    // broadcast
+    result_ = Lanes{} + stoi(num.value_);
+    return 0;
+}
+
+int LaneInterpreter::visit(UnaryOp& uo) {
+    ExpressionDepth depth;
+    if (depth.exceeded()) {
+        evaluateIteratively(uo);
+        return 0;
+    }
+    uo.expr_->accept(*this);
+    if (uo.op_.type_ == TokenType::MINUS) {
+        result_ = -result_;
+    }
+    return 0;
+}
+
+int LaneInterpreter::visit(BinOp& bo) {
+    ExpressionDepth depth;
+    if (depth.exceeded()) {
+        evaluateIteratively(bo);
+        return 0;
+    }
+    bo.left_->accept(*this);
+    Lanes left = result_;
+    bo.right_->accept(*this);
+    combine(bo.op_, left, result_);
+    return 0;
+}
 
-    file.close();
+void LaneInterpreter::evaluateIteratively(AST& expr) {
+    std::vector<Lanes> values;
+    walkExpression(expr, [this, &values](AST& leaf) {
+        leaf.accept(*this);
+        values.push_back(result_);
+    }, [&values](UnaryOp& uo) {
+        if (uo.op_.type_ == TokenType::MINUS) {
+            values.back() = -values.back();
+        }
+    }, [this, &values](BinOp& bo) {
+        Lanes right = values.back();
+        values.pop_back();
+        combine(bo.op_, values.back(), right);
+        values.back() = result_;
+    });
+    result_ = values.back();
+}
+
+void LaneInterpreter::combine(const Token& token, const Lanes& left, const Lanes& right) {
+    TokenType op = token.type_;
+    if (op == TokenType::PLUS) {
+        result_ = left + right;
+    } else if (op == TokenType::MINUS) {
+        result_ = left - right;
+    } else if (op == TokenType::MUL) {
+        result_ = left * right;
+    } else if (op == TokenType::IntegerDiv) {
+        // spare lanes repeat a real instance, so a fault in any lane is real
+        for (size_t lane = 0; lane < LANES; lane++) {
+            result_[lane] = checkedDivide(left[lane], right[lane], token.offset_);
+        }
+    } else if (op == TokenType::FloatDiv) {
+        FloatLanes quotient = __builtin_convertvector(left, FloatLanes) / __builtin_convertvector(right, FloatLanes);
+        result_ = __builtin_convertvector(quotient, Lanes);
+    } else {
+        // vector comparisons give -1 for true
+        Lanes truth = op == TokenType::Equal ? left == right
+                    : op == TokenType::NotEqual ? left != right
+                    : op == TokenType::Less ? left < right
+                    : op == TokenType::LessEqual ? left <= right
+                    : op == TokenType::Greater ? left > right
+                    : left >= right;
+        result_ = -truth;
+    }
+}
+
+void CommonSubexpressions::run(Program& prog) {
+    optimize(*prog.block_);
+}
+
+void CommonSubexpressions::optimize(Block& blk) {
+    for (AST* declaration : blk.declarations_) {
+        if (ProcedureDecl* pd = dynamic_cast<ProcedureDecl*>(declaration)) {
+            optimize(*pd->body());
+        }
+    }
+    optimize(*blk.compoundStatement_);
+}
+
+void CommonSubexpressions::optimize(Compound& comp) {
+    Statement begin = comp.children_.begin();
+    for (Statement it = comp.children_.begin(); it != comp.children_.end(); ++it) {
+        if (dynamic_cast<Assign*>(*it) != nullptr || dynamic_cast<NoOp*>(*it) != nullptr) {
+            continue;
+        }
+        optimizeRun(comp, begin, it);
+        AST* statement = *it;
+        if (Loop* loop = dynamic_cast<Loop*>(statement)) {
+            statement = loop->body_;
+        }
+        if (Compound* nested = dynamic_cast<Compound*>(statement)) {
+            optimize(*nested);
+        }
+        begin = std::next(it);
+    }
+    optimizeRun(comp, begin, comp.children_.end());
+}
+
+void CommonSubexpressions::optimizeRun(Compound& comp, Statement begin, Statement end) {
+    variables_ = AtomMap<uint32_t>();
+    literals_ = AtomMap<uint32_t, uint64_t>();
+    expressions_ = AtomMap<uint32_t, uint64_t>();
+    operators_.clear();
+    occurrences_.assign(1, 0);
+
+    // operators_ of statement i are [firsts[i], firsts[i + 1])
+    std::vector<Statement> statements;
+    std::vector<size_t> firsts;
+    for (Statement it = begin; it != end; ++it) {
+        if (Assign* as = dynamic_cast<Assign*>(*it)) {
+            statements.push_back(it);
+            firsts.push_back(operators_.size());
+            number(as->right_);
+            variables_[as->left_->value_] = newNumber();
+        }
+    }
+    firsts.push_back(operators_.size());
+
+    // A later occurrence of a repeated number reads the temporary, so the
+    // operators below it are not evaluated there. Deciding top down, in
+    // program order, leaves each count at the occurrences that remain.
+    std::vector<bool> seen(occurrences_.size());
+    for (size_t s = 0; s < statements.size(); s++) {
+        for (size_t i = firsts[s + 1]; i-- > firsts[s]; ) {
+            const Operator& op = operators_[i];
+            if (!seen[op.number]) {
+                seen[op.number] = true;
+            } else if (occurrences_[op.number] >= 2) {
+                for (size_t below = i - op.size + 1; below < i; below++) {
+                    occurrences_[operators_[below].number]--;
+                }
+                i -= op.size - 1;
+            }
+        }
+    }
+
+    // The definition of a temporary goes before the statement, or before the
+    // definition of the temporary it is nested in.
+    temporaryOf_.assign(occurrences_.size(), NO_ATOM);
+    for (size_t s = 0; s < statements.size(); s++) {
+        std::vector<std::pair<size_t, Statement>> definitions;   // (first operator, definition)
+        for (size_t i = firsts[s + 1]; i-- > firsts[s]; ) {
+            while (!definitions.empty() && i < definitions.back().first) {
+                definitions.pop_back();
+            }
+            const Operator& op = operators_[i];
+            if (occurrences_[op.number] < 2) {
+                continue;
+            }
+            AST* node = *op.slot;
+            bool first = temporaryOf_[op.number] == NO_ATOM;
+            if (first) {
+                temporaryOf_[op.number] = Interner::intern("$t" + std::to_string(++temporaries_));
+            }
+            Token id(TokenType::ID, temporaryOf_[op.number]);
+            id.offset_ = node->offset_;
+            *op.slot = arena_.make<Var>(id);
+            if (first) {
+                // its operands may repeat as well
+                Token assign(TokenType::Assign, ":=");
+                assign.offset_ = node->offset_;
+                Assign* definition = arena_.make<Assign>(arena_.make<Var>(id), assign, node);
+                definition->offset_ = node->offset_;
+                Statement before = definitions.empty() ? statements[s] : definitions.back().second;
+                definitions.emplace_back(i - op.size + 1, comp.children_.insert(before, definition));
+            } else {
+                eliminated_ += op.size;
+                i -= op.size - 1;
+            }
+        }
+    }
+}
+
+uint32_t CommonSubexpressions::newNumber() {
+    if (occurrences_.size() == MAX_NUMBERS) {
+        throw std::runtime_error("too many values to number in one run");
+    }
+    occurrences_.push_back(0);
+    return occurrences_.size() - 1;
+}
+
+uint32_t CommonSubexpressions::number(AST*& expr) {
+    // like walkExpression, keeping where each node hangs
+    struct Pending {
+        AST** slot;
+        bool expanded;
+        size_t firstOperator;
+    };
+    std::vector<Pending> stack{{&expr, false, 0}};
+    std::vector<uint32_t> values;
+    while (!stack.empty()) {
+        Pending pending = stack.back();
+        stack.pop_back();
+        AST* node = *pending.slot;
+        BinOp* bo = dynamic_cast<BinOp*>(node);
+        UnaryOp* uo = bo == nullptr ? dynamic_cast<UnaryOp*>(node) : nullptr;
+        if (bo == nullptr && uo == nullptr) {
+            uint32_t value;
+            if (Var* var = dynamic_cast<Var*>(node)) {
+                uint32_t& known = variables_[var->value_];
+                value = known != 0 ? known : (known = newNumber());
+            } else {
+                uint32_t& known = literals_[static_cast<uint32_t>(stoi(static_cast<Num*>(node)->value_))];
+                value = known != 0 ? known : (known = newNumber());
+            }
+            values.push_back(value);
+            continue;
+        }
+        if (!pending.expanded) {
+            stack.push_back({pending.slot, true, operators_.size()});
+            if (bo != nullptr) {
+                stack.push_back({&bo->right_, false, 0});
+                stack.push_back({&bo->left_, false, 0});
+            } else {
+                stack.push_back({&uo->expr_, false, 0});
+            }
+            continue;
+        }
+
+        uint64_t operation;
+        if (bo != nullptr) {
+            uint32_t right = values.back();
+            values.pop_back();
+            uint32_t left = values.back();
+            values.pop_back();
+            if ((bo->op_.type_ == TokenType::PLUS || bo->op_.type_ == TokenType::MUL) && right < left) {
+                std::swap(left, right);
+            }
+            operation = key(bo->op_.type_, left, right);
+        } else {
+            operation = key(uo->op_.type_, values.back(), 0);
+            values.pop_back();
+        }
+        uint32_t& known = expressions_[operation];
+        uint32_t value = known != 0 ? known : (known = newNumber());
+        occurrences_[value]++;
+        operators_.push_back({pending.slot, value, static_cast<uint32_t>(operators_.size() - pending.firstOperator + 1)});
+        values.push_back(value);
+    }
+    return values.back();
+}
+
+void DeadStores::run(Program& prog) {
+    safe_.clear();
+    findSafe(*prog.block_);
+    bool removed;
+    do {
+        findNeeded(prog);
+        size_t before = removedStores_;
+        removeStores(*prog.block_, true);
+        removed = removedStores_ != before;
+    } while (removed);
+
+    AtomMap<bool> names;
+    collectNames(*prog.block_, names);
+    removeDeclarations(*prog.block_, names);
+}
+
+template <typename F>
+static void forEachRead(AST& expr, F fn) {
+    walkExpression(expr, [&fn](AST& leaf) {
+        if (Var* var = dynamic_cast<Var*>(&leaf)) {
+            fn(var->value_);
+        }
+    }, [](UnaryOp&) {}, [](BinOp&) {});
+}
+
+void DeadStores::findSafe(Block& blk) {
+    for (AST* declaration : blk.declarations_) {
+        if (ProcedureDecl* pd = dynamic_cast<ProcedureDecl*>(declaration)) {
+            findSafe(*pd->body());
+        }
+    }
+    AtomMap<bool> assigned;
+    findSafe(*blk.compoundStatement_, assigned);
+}
+
+void DeadStores::findSafe(Compound& comp, AtomMap<bool>& assigned) {
+    for (AST* statement : comp.children_) {
+        if (Assign* as = dynamic_cast<Assign*>(statement)) {
+            bool mayFault = false;
+            walkExpression(*as->right_, [&assigned, &mayFault](AST& leaf) {
+                if (Var* var = dynamic_cast<Var*>(&leaf)) {
+                    mayFault |= assigned.find(var->value_) == nullptr;
+                }
+            }, [](UnaryOp&) {}, [&mayFault](BinOp& bo) {
+                if (bo.op_.type_ == TokenType::IntegerDiv || bo.op_.type_ == TokenType::FloatDiv) {
+                    Num* divisor = dynamic_cast<Num*>(bo.right_);
+                    mayFault |= divisor == nullptr || stoi(divisor->value_) == 0;
+                }
+            });
+            if (!mayFault) {
+                safe_.insert(as);
+            }
+            assigned[as->left_->value_] = true;
+        } else if (Compound* nested = dynamic_cast<Compound*>(statement)) {
+            findSafe(*nested, assigned);
+        }
+        // the body of a loop may not run, none of its stores is removed
+    }
+}
+
+/*
+* A variable is needed when it is shown, when a store that stays reads it,
+* or when the right side of a store to a needed variable reads it.
+*/
+void DeadStores::findNeeded(Program& prog) {
+    sources_ = AtomMap<std::vector<Atom>>();
+    needed_ = AtomMap<bool>();
+    std::vector<Atom> work;
+    auto need = [this, &work](Atom name) {
+        bool& needed = needed_[name];
+        if (!needed) {
+            needed = true;
+            work.push_back(name);
+        }
+    };
+    for (Atom output : outputs_) {
+        need(output);
+    }
+    findSources(*prog.block_, need);
+    while (!work.empty()) {
+        std::vector<Atom>* sources = sources_.find(work.back());
+        work.pop_back();
+        if (sources != nullptr) {
+            for (Atom source : *sources) {
+                need(source);
+            }
+        }
+    }
+}
+
+template <typename F>
+void DeadStores::findSources(Block& blk, F& need) {
+    for (AST* declaration : blk.declarations_) {
+        if (ProcedureDecl* pd = dynamic_cast<ProcedureDecl*>(declaration)) {
+            findSources(*pd->body(), need);
+        }
+    }
+    findSources(*blk.compoundStatement_, need);
+}
+
+template <typename F>
+void DeadStores::findSources(Compound& comp, F& need) {
+    for (AST* statement : comp.children_) {
+        if (Assign* as = dynamic_cast<Assign*>(statement)) {
+            Atom name = as->left_->value_;
+            std::vector<Atom>& sources = sources_[name];
+            if (safe_.count(as) == 0) {
+                forEachRead(*as->right_, need);
+            } else {
+                forEachRead(*as->right_, [&sources](Atom source) {
+                    sources.push_back(source);
+                });
+            }
+            if (outputs_.empty() && !CommonSubexpressions::isTemporary(name)) {
+                need(name);
+            }
+        } else if (Compound* nested = dynamic_cast<Compound*>(statement)) {
+            findSources(*nested, need);
+        } else if (dynamic_cast<Loop*>(statement) != nullptr) {
+            // the stores of a loop stay, so everything it reads is needed
+            AtomMap<bool> reads;
+            collectNames(*statement, reads);
+            reads.forEach([&need](Atom name, bool) {
+                need(name);
+            });
+        }
+    }
+}
+
+void DeadStores::removeStores(Block& blk, bool program) {
+    for (AST* declaration : blk.declarations_) {
+        if (ProcedureDecl* pd = dynamic_cast<ProcedureDecl*>(declaration)) {
+            removeStores(*pd->body(), false);
+        }
+    }
+
+    Liveness live;
+    if (!program) {
+        live.everything();
+    } else if (outputs_.empty()) {
+        live.everything();
+        sources_.forEach([&live](Atom name, const std::vector<Atom>&) {
+            if (CommonSubexpressions::isTemporary(name)) {
+                live.kill(name);
+            }
+        });
+    } else {
+        for (Atom output : outputs_) {
+            live.gen(output);
+        }
+    }
+    removeStores(*blk.compoundStatement_, live);
+}
+
+void DeadStores::removeStores(Compound& comp, Liveness& live) {
+    for (auto it = comp.children_.end(); it != comp.children_.begin(); ) {
+        --it;
+        if (Assign* as = dynamic_cast<Assign*>(*it)) {
+            Atom name = as->left_->value_;
+            if ((needed_.find(name) == nullptr || !live.contains(name)) && safe_.count(as) != 0) {
+                it = comp.children_.erase(it);
+                removedStores_++;
+                continue;
+            }
+            live.kill(name);
+            forEachRead(*as->right_, [&live](Atom source) {
+                live.gen(source);
+            });
+        } else if (dynamic_cast<ProcedureCall*>(*it) != nullptr || dynamic_cast<Loop*>(*it) != nullptr) {
+            live.everything();
+        } else if (Compound* nested = dynamic_cast<Compound*>(*it)) {
+            removeStores(*nested, live);
+        }
+    }
+}
+
+void DeadStores::collectNames(Block& blk, AtomMap<bool>& names) {
+    for (AST* declaration : blk.declarations_) {
+        if (ProcedureDecl* pd = dynamic_cast<ProcedureDecl*>(declaration)) {
+            collectNames(*pd->body(), names);
+        }
+    }
+    collectNames(*blk.compoundStatement_, names);
+}
+
+void DeadStores::collectNames(Compound& comp, AtomMap<bool>& names) {
+    for (AST* statement : comp.children_) {
+        collectNames(*statement, names);
+    }
+}
+
+void DeadStores::collectNames(AST& statement, AtomMap<bool>& names) {
+    if (Assign* as = dynamic_cast<Assign*>(&statement)) {
+        names[as->left_->value_] = true;
+        forEachRead(*as->right_, [&names](Atom name) {
+            names[name] = true;
+        });
+    } else if (Compound* nested = dynamic_cast<Compound*>(&statement)) {
+        collectNames(*nested, names);
+    } else if (While* loop = dynamic_cast<While*>(&statement)) {
+        forEachRead(*loop->condition_, [&names](Atom name) {
+            names[name] = true;
+        });
+        collectNames(*loop->body_, names);
+    } else if (For* loop = dynamic_cast<For*>(&statement)) {
+        names[loop->variable_->value_] = true;
+        for (AST* bound : {loop->from_, loop->to_}) {
+            forEachRead(*bound, [&names](Atom name) {
+                names[name] = true;
+            });
+        }
+        collectNames(*loop->body_, names);
+    }
+}
+
+void DeadStores::removeDeclarations(Block& blk, AtomMap<bool>& names) {
+    for (auto it = blk.declarations_.begin(); it != blk.declarations_.end(); ) {
+        if (ProcedureDecl* pd = dynamic_cast<ProcedureDecl*>(*it)) {
+            removeDeclarations(*pd->body(), names);
+        } else if (VarDecl* vDecl = dynamic_cast<VarDecl*>(*it)) {
+            if (names.find(vDecl->varNode_->value_) == nullptr) {
+                it = blk.declarations_.erase(it);
+                removedDeclarations_++;
+                continue;
+            }
+        }
+        ++it;
+    }
+}
+
+bool IRInstruction::mayFault(const std::vector<IRInstruction>& code) const {
+    if (op != IROp::IntegerDiv && op != IROp::FloatDiv) {
+        return false;
+    }
+    const IRInstruction& divisor = code[b];
+    // INT_MIN DIV -1 traps like a division by zero
+    return divisor.op != IROp::Const || divisor.value == 0 || (op == IROp::IntegerDiv && divisor.value == -1);
+}
+
+size_t IRFunction::size() const {
+    return std::count_if(code.begin(), code.end(), [](const IRInstruction& ins) {
+        return ins.op != IROp::Nop;
+    });
+}
+
+void IRFunction::print(std::ostream& out) const {
+    static const char* const NAMES[] = {
+        "const", "load", "store", "copy", "neg", "add", "sub", "mul", "div", "fdiv", "call", "loop", "nop"
+    };
+    out << "function " << Interner::name(name);
+    if (loop != nullptr) {
+        out << ", loop at " << loop->offset_;
+    }
+    out << std::endl;
+    for (uint32_t i = 0; i < code.size(); i++) {
+        const IRInstruction& ins = code[i];
+        if (ins.op == IROp::Nop) {
+            continue;
+        }
+        out << "    ";
+        if (ins.op != IROp::Store && ins.op != IROp::Call && ins.op != IROp::Loop) {
+            out << "%" << i << " = ";
+        }
+        out << NAMES[static_cast<size_t>(ins.op)];
+        if (ins.op == IROp::Const) {
+            out << " " << ins.value;
+        } else if (ins.op == IROp::Loop) {
+            out << " at " << loops[ins.value]->offset_;
+        }
+        if (ins.var != NO_ATOM && ins.op != IROp::Copy) {
+            out << " " << Interner::name(ins.var);
+        }
+        if (ins.a != IRInstruction::NO_VALUE) {
+            out << (ins.op == IROp::Store ? ", %" : " %") << ins.a;
+        }
+        if (ins.b != IRInstruction::NO_VALUE) {
+            out << ", %" << ins.b;
+        }
+        if (ins.op == IROp::Copy) {
+            // the version of a variable it defines
+            out << "    ; " << Interner::name(ins.var);
+        }
+        out << std::endl;
+    }
+}
+
+std::vector<IRFunction> IRBuilder::build(Program& prog) {
+    std::vector<IRFunction> functions;
+    build(*prog.block_, prog.name_, functions);
+    return functions;
+}
+
+void IRBuilder::build(Block& blk, Atom name, std::vector<IRFunction>& functions) {
+    for (AST* declaration : blk.declarations_) {
+        if (ProcedureDecl* pd = dynamic_cast<ProcedureDecl*>(declaration)) {
+            build(*pd->body(), pd->name_, functions);
+        }
+    }
+    build(*blk.compoundStatement_, name, nullptr, functions);
+}
+
+void IRBuilder::build(Compound& comp, Atom name, Loop* loop, std::vector<IRFunction>& functions) {
+    functions.push_back(IRFunction{name, &comp, loop, {}, {}});
+    versions_ = AtomMap<uint32_t>();
+    std::vector<Loop*> bodies;
+    append(comp, functions.back(), bodies);
+    for (Loop* body : bodies) {
+        build(static_cast<Compound&>(*body->body_), name, body, functions);
+    }
+}
+
+uint32_t IRBuilder::emit(IRFunction& fn, IRInstruction instruction) {
+    if (fn.code.size() >= IRInstruction::NO_VALUE) {
+        throw std::runtime_error("too many instructions in one block");
+    }
+    fn.code.push_back(instruction);
+    return fn.code.size() - 1;
+}
+
+void IRBuilder::append(Compound& comp, IRFunction& fn, std::vector<Loop*>& bodies) {
+    for (AST* statement : comp.children_) {
+        if (Assign* as = dynamic_cast<Assign*>(statement)) {
+            Atom name = as->left_->value_;
+            uint32_t value = expression(*as->right_, fn);
+            IRInstruction copy{IROp::Copy, value};
+            copy.var = name;
+            copy.offset = as->offset_;
+            uint32_t version = emit(fn, copy);
+            versions_[name] = version;
+            IRInstruction store{IROp::Store, version};
+            store.var = name;
+            store.offset = as->offset_;
+            emit(fn, store);
+        } else if (ProcedureCall* pc = dynamic_cast<ProcedureCall*>(statement)) {
+            IRInstruction call{IROp::Call};
+            call.var = pc->procName_;
+            call.offset = pc->offset_;
+            emit(fn, call);
+            versions_ = AtomMap<uint32_t>();
+        } else if (Loop* loop = dynamic_cast<Loop*>(statement)) {
+            IRInstruction instruction{IROp::Loop};
+            instruction.value = fn.loops.size();
+            instruction.offset = loop->offset_;
+            emit(fn, instruction);
+            fn.loops.push_back(loop);
+            versions_ = AtomMap<uint32_t>();
+            if (dynamic_cast<Compound*>(loop->body_) != nullptr) {
+                bodies.push_back(loop);
+            }
+        } else if (Compound* nested = dynamic_cast<Compound*>(statement)) {
+            append(*nested, fn, bodies);
+        }
+    }
+}
+
+uint32_t IRBuilder::expression(AST& expr, IRFunction& fn) {
+    std::vector<uint32_t> values;
+    walkExpression(expr, [this, &fn, &values](AST& leaf) {
+        if (Var* var = dynamic_cast<Var*>(&leaf)) {
+            uint32_t* version = versions_.find(var->value_);
+            if (version == nullptr) {
+                IRInstruction load{IROp::Load};
+                load.var = var->value_;
+                load.offset = var->offset_;
+                version = &(versions_[var->value_] = emit(fn, load));
+            }
+            values.push_back(*version);
+        } else {
+            IRInstruction constant{IROp::Const};
+            constant.value = stoi(static_cast<Num&>(leaf).value_);
+            constant.offset = leaf.offset_;
+            values.push_back(emit(fn, constant));
+        }
+    }, [this, &fn, &values](UnaryOp& uo) {
+        if (uo.op_.type_ == TokenType::MINUS) {
+            IRInstruction neg{IROp::Neg, values.back()};
+            neg.offset = uo.offset_;
+            values.back() = emit(fn, neg);
+        }
+    }, [this, &fn, &values](BinOp& bo) {
+        uint32_t right = values.back();
+        values.pop_back();
+        IROp op = IROp::Add;
+        if (bo.op_.type_ == TokenType::MINUS) {
+            op = IROp::Sub;
+        } else if (bo.op_.type_ == TokenType::MUL) {
+            op = IROp::Mul;
+        } else if (bo.op_.type_ == TokenType::IntegerDiv) {
+            op = IROp::IntegerDiv;
+        } else if (bo.op_.type_ == TokenType::FloatDiv) {
+            op = IROp::FloatDiv;
+        }
+        IRInstruction binary{op, values.back(), right};
+        binary.offset = bo.offset_;
+        values.back() = emit(fn, binary);
+    });
+    return values.back();
+}
+
+size_t ConstantPropagation::run(IRFunction& fn) {
+    std::vector<IRInstruction>& code = fn.code;
+    size_t folded = 0;
+    for (IRInstruction& ins : code) {
+        bool constantA = ins.a != IRInstruction::NO_VALUE && code[ins.a].op == IROp::Const;
+        bool constantB = ins.b != IRInstruction::NO_VALUE && code[ins.b].op == IROp::Const;
+        if (ins.op == IROp::Copy && constantA) {
+            ins.value = code[ins.a].value;
+        } else if (ins.op == IROp::Neg && constantA) {
+            ins.value = -code[ins.a].value;
+        } else if (ins.op >= IROp::Add && ins.op <= IROp::FloatDiv && constantA && constantB && !ins.mayFault(code)) {
+            static const TokenType OPERATORS[] = {
+                TokenType::PLUS, TokenType::MINUS, TokenType::MUL, TokenType::IntegerDiv, TokenType::FloatDiv
+            };
+            TokenType op = OPERATORS[static_cast<size_t>(ins.op) - static_cast<size_t>(IROp::Add)];
+            ins.value = applyBinary(op, code[ins.a].value, code[ins.b].value, ins.offset);
+        } else {
+            continue;
+        }
+        ins.op = IROp::Const;
+        ins.a = ins.b = IRInstruction::NO_VALUE;
+        ins.var = NO_ATOM;
+        folded++;
+    }
+    return folded;
+}
+
+size_t CopyPropagation::run(IRFunction& fn) {
+    std::vector<IRInstruction>& code = fn.code;
+    size_t replaced = 0;
+    for (IRInstruction& ins : code) {
+        // copies before ins already name no copy
+        for (uint32_t* operand : {&ins.a, &ins.b}) {
+            if (*operand != IRInstruction::NO_VALUE && code[*operand].op == IROp::Copy) {
+                *operand = code[*operand].a;
+                replaced++;
+            }
+        }
+    }
+    return replaced;
+}
+
+size_t DeadCodeElimination::run(IRFunction& fn) {
+    std::vector<IRInstruction>& code = fn.code;
+    std::vector<uint32_t> uses(code.size());
+    std::vector<bool> safeLoad(code.size());
+    AtomMap<bool> stored;
+    for (uint32_t i = 0; i < code.size(); i++) {
+        const IRInstruction& ins = code[i];
+        for (uint32_t operand : {ins.a, ins.b}) {
+            if (operand != IRInstruction::NO_VALUE) {
+                uses[operand]++;
+            }
+        }
+        if (ins.op == IROp::Load) {
+            safeLoad[i] = stored.find(ins.var) != nullptr;
+        } else if (ins.op == IROp::Store) {
+            stored[ins.var] = true;
+        }
+    }
+
+    // backwards, so removing a user can free its operands in the same sweep
+    size_t removed = 0;
+    AtomMap<bool> overwritten;      // stored again before any read
+    for (uint32_t i = code.size(); i-- > 0; ) {
+        IRInstruction& ins = code[i];
+        bool dead = false;
+        if (ins.op == IROp::Store) {
+            bool& later = overwritten[ins.var];
+            dead = later;
+            later = true;
+        } else if (ins.op == IROp::Call || ins.op == IROp::Loop) {
+            overwritten = AtomMap<bool>();
+        } else if (ins.op == IROp::Load) {
+            dead = uses[i] == 0 && safeLoad[i];
+            if (!dead) {
+                overwritten[ins.var] = false;
+            }
+        } else if (ins.op != IROp::Nop) {
+            dead = uses[i] == 0 && !ins.mayFault(code);
+        }
+        if (!dead) {
+            continue;
+        }
+        for (uint32_t operand : {ins.a, ins.b}) {
+            if (operand != IRInstruction::NO_VALUE) {
+                uses[operand]--;
+            }
+        }
+        ins = IRInstruction{IROp::Nop};
+        removed++;
+    }
+    return removed;
+}
+
+std::unique_ptr<IRPass> PassManager::create(const std::string& name) {
+    if (name == "constprop") {
+        return std::make_unique<ConstantPropagation>();
+    }
+    if (name == "copyprop") {
+        return std::make_unique<CopyPropagation>();
+    }
+    if (name == "dce") {
+        return std::make_unique<DeadCodeElimination>();
+    }
+    throw std::runtime_error("unknown pass: " + name);
+}
+
+void PassManager::run(std::vector<IRFunction>& functions) {
+    if (dump_ != nullptr) {
+        *dump_ << "; built" << std::endl;
+        for (const IRFunction& fn : functions) {
+            fn.print(*dump_);
+        }
+    }
+    for (const std::unique_ptr<IRPass>& pass : passes_) {
+        auto start = std::chrono::steady_clock::now();
+        size_t changed = 0;
+        for (IRFunction& fn : functions) {
+            changed += pass->run(fn);
+        }
+        timings_.push_back({pass->name(), std::chrono::steady_clock::now() - start, changed});
+        if (dump_ != nullptr) {
+            *dump_ << "; after " << pass->name() << std::endl;
+            for (const IRFunction& fn : functions) {
+                fn.print(*dump_);
+            }
+        }
+    }
+}
+
+void IRLowering::lower(std::vector<IRFunction>& functions) {
+    for (IRFunction& fn : functions) {
+        lower(fn);
+    }
+}
+
+void IRLowering::lower(IRFunction& fn) {
+    const std::vector<IRInstruction>& code = fn.code;
+    code_ = &code;
+    statements_.clear();
+    uses_.assign(code.size(), 0);
+    trees_.assign(code.size(), nullptr);
+    users_.assign(code.size(), PENDING);
+    temporaryOf_.assign(code.size(), NO_ATOM);
+    leafOf_.assign(code.size(), IRInstruction::NO_VALUE);
+    loadUses_.assign(code.size(), {});
+    loads_ = AtomMap<std::vector<uint32_t>>();
+    loaded_.clear();
+    for (const IRInstruction& ins : code) {
+        for (uint32_t operand : {ins.a, ins.b}) {
+            if (operand != IRInstruction::NO_VALUE) {
+                uses_[operand]++;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < code.size(); i++) {
+        const IRInstruction& ins = code[i];
+        switch (ins.op) {
+        case IROp::Nop:
+            break;
+        case IROp::Const:
+            // a fresh Num for every use
+            leafOf_[i] = i;
+            break;
+        case IROp::Load: {
+            leafOf_[i] = i;
+            if (uses_[i] == 0) {
+                // unused, but it may fault
+                temporaryOf_[i] = temporary();
+                assign(temporaryOf_[i], variable(ins.var, ins.offset), ins.offset);
+                break;
+            }
+            std::vector<uint32_t>& loads = loads_[ins.var];
+            if (loads.empty()) {
+                loaded_.push_back(ins.var);
+            }
+            loads.push_back(i);
+            break;
+        }
+        case IROp::Store: {
+            AST* tree = take(ins.a, i);
+            users_[i] = DONE;
+            release(ins.var);
+            assign(ins.var, tree, ins.offset);
+            break;
+        }
+        case IROp::Call: {
+            release(NO_ATOM);
+            Token id(TokenType::ID, ins.var);
+            id.offset_ = ins.offset;
+            statements_.push_back(arena_.make<ProcedureCall>(id));
+            break;
+        }
+        case IROp::Loop:
+            release(NO_ATOM);
+            statements_.push_back(fn.loops[ins.value]);
+            break;
+        case IROp::Copy:
+            if (leafOf_[ins.a] != IRInstruction::NO_VALUE) {
+                // a copy of a leaf is that leaf, taken once per use of the copy
+                leafOf_[i] = leafOf_[ins.a];
+                uses_[leafOf_[i]] += uses_[i];
+                uses_[leafOf_[i]]--;
+                break;
+            }
+            materialize(i, take(ins.a, i));
+            break;
+        case IROp::Neg: {
+            Token minus(TokenType::MINUS, "-");
+            minus.offset_ = ins.offset;
+            materialize(i, arena_.make<UnaryOp>(minus, take(ins.a, i)));
+            break;
+        }
+        default: {
+            static const Token OPERATORS[] = {
+                Token(TokenType::PLUS, "+"), Token(TokenType::MINUS, "-"), Token(TokenType::MUL, "*"),
+                Token(TokenType::IntegerDiv, "DIV"), Token(TokenType::FloatDiv, "/")
+            };
+            Token op = OPERATORS[static_cast<size_t>(ins.op) - static_cast<size_t>(IROp::Add)];
+            op.offset_ = ins.offset;
+            AST* left = take(ins.a, i);
+            AST* right = take(ins.b, i);
+            materialize(i, arena_.make<BinOp>(left, std::move(op), right));
+            break;
+        }
+        }
+    }
+    fn.target->children_ = std::move(statements_);
+    statements_.clear();
+}
+
+AST* IRLowering::take(uint32_t value, uint32_t user) {
+    if (leafOf_[value] != IRInstruction::NO_VALUE) {
+        value = leafOf_[value];
+    }
+    const IRInstruction* ins = &(*code_)[value];
+    uses_[value]--;
+    if (temporaryOf_[value] != NO_ATOM) {
+        return variable(temporaryOf_[value], ins->offset);
+    }
+    if (ins->op == IROp::Const) {
+        Token number(TokenType::IntegerConst, std::to_string(ins->value));
+        number.offset_ = ins->offset;
+        return arena_.make<Num>(number);
+    }
+    if (ins->op == IROp::Load) {
+        Var* node = variable(ins->var, ins->offset);
+        loadUses_[value].push_back({node, user});
+        return node;
+    }
+    users_[value] = user;
+    return trees_[value];
+}
+
+uint32_t IRLowering::root(uint32_t user) {
+    uint32_t top = user;
+    while (users_[top] != PENDING && users_[top] != DONE) {
+        top = users_[top];
+    }
+    uint32_t result = users_[top] == DONE ? DONE : top;
+    // point the chain straight at the result
+    while (users_[user] != PENDING && users_[user] != DONE) {
+        uint32_t next = users_[user];
+        users_[user] = result == DONE ? DONE : top;
+        user = next;
+    }
+    return result;
+}
+
+void IRLowering::materialize(uint32_t value, AST* tree) {
+    const IRInstruction& ins = (*code_)[value];
+    if (uses_[value] == 1) {
+        trees_[value] = tree;
+        return;
+    }
+    users_[value] = DONE;
+    if (uses_[value] == 0 && !ins.mayFault(*code_)) {
+        return;
+    }
+    temporaryOf_[value] = temporary();
+    leafOf_[value] = value;
+    assign(temporaryOf_[value], tree, ins.offset);
+}
+
+void IRLowering::release(Atom var) {
+    if (var == NO_ATOM) {
+        for (Atom loaded : loaded_) {
+            release(loaded);
+        }
+        loaded_.clear();
+        return;
+    }
+    std::vector<uint32_t>* loads = loads_.find(var);
+    if (loads == nullptr) {
+        return;
+    }
+    for (uint32_t load : *loads) {
+        releaseLoad(load);
+    }
+    loads->clear();
+}
+
+void IRLowering::releaseLoad(uint32_t load) {
+    if (temporaryOf_[load] != NO_ATOM) {
+        return;
+    }
+    std::vector<LoadUse>& loadUses = loadUses_[load];
+    bool needed = uses_[load] > 0;
+    for (const LoadUse& use : loadUses) {
+        needed |= root(use.user) != DONE;
+    }
+    if (!needed) {
+        loadUses.clear();
+        return;
+    }
+    const IRInstruction& ins = (*code_)[load];
+    temporaryOf_[load] = temporary();
+    assign(temporaryOf_[load], variable(ins.var, ins.offset), ins.offset);
+    for (const LoadUse& use : loadUses) {
+        if (root(use.user) != DONE) {
+            use.node->value_ = use.node->token_.atom_ = temporaryOf_[load];
+        }
+    }
+    loadUses.clear();
+}
+
+Atom IRLowering::temporary() {
+    return Interner::intern("$v" + std::to_string(++temporaries_));
+}
+
+Var* IRLowering::variable(Atom name, uint32_t offset) {
+    Token id(TokenType::ID, name);
+    id.offset_ = offset;
+    return arena_.make<Var>(id);
+}
+
+void IRLowering::assign(Atom name, AST* tree, uint32_t offset) {
+    Token op(TokenType::Assign, ":=");
+    op.offset_ = offset;
+    Assign* as = arena_.make<Assign>(variable(name, offset), op, tree);
+    as->offset_ = offset;
+    statements_.push_back(as);
+}
+
+Loop::~Loop() = default;
+
+DivisionMagic DivisionMagic::of(int32_t divisor) {
+    const uint32_t two31 = 0x80000000u;
+    uint32_t d = divisor;
+    uint32_t nc = two31 - 1 - two31 % d;    // largest multiple of d, less one, below 2 ** 31
+    int32_t p = 31;
+    uint32_t q1 = two31 / nc;
+    uint32_t r1 = two31 - q1 * nc;
+    uint32_t q2 = two31 / d;
+    uint32_t r2 = two31 - q2 * d;
+    uint32_t delta;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= nc) {
+            q1++;
+            r1 -= nc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= d) {
+            q2++;
+            r2 -= d;
+        }
+        delta = d - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    return {static_cast<int32_t>(q2 + 1), p - 32};
+}
+
+const Bytecode& Loop::compiled(PeepholeOptimizer* peephole) {
+    std::call_once(compileOnce_, [this, peephole] {
+        compiled_ = std::make_unique<Bytecode>(BytecodeCompiler().compile(*this));
+        (peephole != nullptr ? *peephole : PeepholeOptimizer::standard()).run(*compiled_);
+    });
+    return *compiled_;
+}
+
+Bytecode BytecodeCompiler::compile(Loop& loop) {
+    code_ = Bytecode();
+    slots_ = AtomMap<uint32_t>();
+    inductions_.clear();
+    depth_ = 0;
+    if (For* counted = dynamic_cast<For*>(&loop)) {
+        this->loop(*counted, true);
+    } else {
+        this->loop(static_cast<While&>(loop));
+    }
+    emit(Opcode::Exit);
+    return std::move(code_);
+}
+
+uint32_t BytecodeCompiler::emit(Opcode op, int32_t a, int32_t b) {
+    switch (op) {
+    case Opcode::Push:
+    case Opcode::Load:
+        depth_++;
+        code_.maxStack = std::max(code_.maxStack, depth_);
+        break;
+    case Opcode::Neg:
+    case Opcode::Shl:
+    case Opcode::DivPow2:
+    case Opcode::DivMagic:
+    case Opcode::Call:
+    case Opcode::Loop:
+    case Opcode::Next:
+    case Opcode::Step:
+    case Opcode::Exit:
+        break;
+    default:
+        // binary operators, Store and JumpIfFalse take one value more than they leave
+        depth_--;
+        break;
+    }
+    code_.code.push_back({op, a, b});
+    return code_.code.size() - 1;
+}
+
+uint32_t BytecodeCompiler::slot(Atom name) {
+    uint32_t* found = slots_.find(name);
+    if (found != nullptr) {
+        return *found;
+    }
+    code_.slots.push_back(name);
+    return slots_[name] = code_.slots.size() - 1;
+}
+
+uint32_t BytecodeCompiler::temporary() {
+    code_.slots.push_back(NO_ATOM);
+    return code_.slots.size() - 1;
+}
+
+void BytecodeCompiler::loop(While& loop) {
+    uint32_t index = code_.loops.size();
+    code_.loops.push_back({1, 0, &loop});
+    uint32_t test = code_.code.size();
+    expression(*loop.condition_);
+    uint32_t exit = emit(Opcode::JumpIfFalse);
+    statement(*loop.body_, index);
+    emit(Opcode::Loop, test, index);
+    code_.code[exit].a = code_.code.size();
+}
+
+void BytecodeCompiler::loop(For& loop, bool entered) {
+    uint32_t counter = temporary();
+    uint32_t bound = temporary();
+    uint32_t exit = UINT32_MAX;
+    if (!entered) {
+        expression(*loop.from_);
+        emit(Opcode::Store, counter);
+        expression(*loop.to_);
+        emit(Opcode::Store, bound);
+        int from = 0;
+        int to = 0;
+        if (!constant(*loop.from_, from) || !constant(*loop.to_, to) || from > to) {
+            emit(Opcode::Load, counter);
+            emit(Opcode::Load, bound);
+            emit(Opcode::LessEqual);
+            exit = emit(Opcode::JumpIfFalse);
+        }
+    }
+
+    Induction induction{slot(loop.variable_->value_), {}};
+    std::vector<int> factors;
+    if (findProducts(*loop.body_, loop.variable_->value_, factors)) {
+        for (int factor : factors) {
+            uint32_t product = temporary();
+            emit(Opcode::Load, counter);
+            emit(Opcode::Push, factor);
+            emit(Opcode::Mul);
+            emit(Opcode::Store, product);
+            induction.products.emplace_back(factor, product);
+        }
+    }
+
+    uint32_t index = code_.loops.size();
+    code_.loops.push_back({1, 0, &loop, counter});
+    uint32_t head = code_.code.size();
+    emit(Opcode::Load, counter);
+    emit(Opcode::Store, induction.variable);
+    inductions_.push_back(induction);
+    statement(*loop.body_, index);
+    inductions_.pop_back();
+    for (const std::pair<int, uint32_t>& product : induction.products) {
+        emit(Opcode::Step, product.second, product.first);
+    }
+    emit(Opcode::Next, head, index);
+    if (exit != UINT32_MAX) {
+        code_.code[exit].a = code_.code.size();
+    }
+}
+
+bool BytecodeCompiler::findProducts(AST& body, Atom variable, std::vector<int>& factors) {
+    auto scan = [variable, &factors](AST& expr) {
+        walkExpression(expr, [](AST&) {}, [](UnaryOp&) {}, [variable, &factors](BinOp& bo) {
+            if (bo.op_.type_ != TokenType::MUL) {
+                return;
+            }
+            Var* var = dynamic_cast<Var*>(bo.left_);
+            Num* num = dynamic_cast<Num*>(bo.right_);
+            if (var == nullptr) {
+                var = dynamic_cast<Var*>(bo.right_);
+                num = dynamic_cast<Num*>(bo.left_);
+            }
+            if (var == nullptr || num == nullptr || var->value_ != variable) {
+                return;
+            }
+            int factor = stoi(num->value_);
+            if (std::find(factors.begin(), factors.end(), factor) == factors.end()) {
+                factors.push_back(factor);
+            }
+        });
+    };
+
+    if (Assign* as = dynamic_cast<Assign*>(&body)) {
+        scan(*as->right_);
+        return as->left_->value_ != variable;
+    }
+    if (Compound* comp = dynamic_cast<Compound*>(&body)) {
+        for (AST* child : comp->children_) {
+            if (!findProducts(*child, variable, factors)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (While* loop = dynamic_cast<While*>(&body)) {
+        scan(*loop->condition_);
+        return findProducts(*loop->body_, variable, factors);
+    }
+    if (For* loop = dynamic_cast<For*>(&body)) {
+        scan(*loop->from_);
+        scan(*loop->to_);
+        return loop->variable_->value_ != variable && findProducts(*loop->body_, variable, factors);
+    }
+    // a procedure may assign any variable
+    return dynamic_cast<ProcedureCall*>(&body) == nullptr;
+}
+
+bool BytecodeCompiler::constant(AST& expr, int& value) {
+    std::vector<int> values;
+    bool known = true;
+    walkExpression(expr, [&values, &known](AST& leaf) {
+        Num* num = dynamic_cast<Num*>(&leaf);
+        known &= num != nullptr;
+        values.push_back(num != nullptr ? stoi(num->value_) : 0);
+    }, [&values](UnaryOp& uo) {
+        if (uo.op_.type_ == TokenType::MINUS) {
+            values.back() = -values.back();
+        }
+    }, [&values, &known](BinOp& bo) {
+        int right = values.back();
+        values.pop_back();
+        bool division = bo.op_.type_ == TokenType::IntegerDiv || bo.op_.type_ == TokenType::FloatDiv;
+        if (division && (right == 0 || right == -1)) {
+            known = false;
+            return;
+        }
+        values.back() = applyBinary(bo.op_.type_, values.back(), right, bo.op_.offset_);
+    });
+    value = values.back();
+    return known;
+}
+
+void BytecodeCompiler::statement(AST& node, uint32_t loop) {
+    if (Assign* as = dynamic_cast<Assign*>(&node)) {
+        expression(*as->right_);
+        emit(Opcode::Store, slot(as->left_->value_));
+        code_.loops[loop].statements++;
+    } else if (Compound* comp = dynamic_cast<Compound*>(&node)) {
+        code_.loops[loop].steps += comp->children_.size();
+        for (AST* child : comp->children_) {
+            statement(*child, loop);
+        }
+    } else if (ProcedureCall* pc = dynamic_cast<ProcedureCall*>(&node)) {
+        // the interpreter counts the call itself
+        code_.calls.push_back(pc);
+        emit(Opcode::Call, code_.calls.size() - 1);
+    } else if (While* nested = dynamic_cast<While*>(&node)) {
+        this->loop(*nested);
+    } else if (For* counted = dynamic_cast<For*>(&node)) {
+        this->loop(*counted, false);
+    }
+}
+
+void BytecodeCompiler::expression(AST& expr) {
+    walkExpression(expr, [this](AST& leaf) {
+        if (Var* var = dynamic_cast<Var*>(&leaf)) {
+            emit(Opcode::Load, slot(var->value_));
+        } else {
+            emit(Opcode::Push, stoi(static_cast<Num&>(leaf).value_));
+        }
+    }, [this](UnaryOp& uo) {
+        if (uo.op_.type_ == TokenType::MINUS) {
+            emit(Opcode::Neg);
+        }
+    }, [this](BinOp& bo) {
+        static const std::pair<TokenType, Opcode> OPCODES[] = {
+            {TokenType::PLUS, Opcode::Add}, {TokenType::MINUS, Opcode::Sub}, {TokenType::MUL, Opcode::Mul},
+            {TokenType::IntegerDiv, Opcode::Div}, {TokenType::FloatDiv, Opcode::FloatDiv},
+            {TokenType::Equal, Opcode::Equal}, {TokenType::NotEqual, Opcode::NotEqual},
+            {TokenType::Less, Opcode::Less}, {TokenType::LessEqual, Opcode::LessEqual},
+            {TokenType::Greater, Opcode::Greater}, {TokenType::GreaterEqual, Opcode::GreaterEqual},
+        };
+        if (bo.op_.type_ == TokenType::MUL && reduceProduct()) {
+            return;
+        }
+        if ((bo.op_.type_ == TokenType::MUL || bo.op_.type_ == TokenType::IntegerDiv) && reduceByConstant(bo.op_.type_)) {
+            return;
+        }
+        for (const std::pair<TokenType, Opcode>& opcode : OPCODES) {
+            if (opcode.first == bo.op_.type_) {
+                // a Div keeps its operator's offset for the error of a faulting divisor
+                emit(opcode.second, opcode.second == Opcode::Div ? static_cast<int32_t>(bo.op_.offset_) : 0);
+                return;
+            }
+        }
+        throw std::runtime_error("unknown binary operator");
+    });
+}
+
+bool BytecodeCompiler::reduceProduct() {
+    size_t size = code_.code.size();
+    if (size < 2) {
+        return false;
+    }
+    // the operands of a binary operator over two leaves end the code
+    const Instruction& first = code_.code[size - 2];
+    const Instruction& second = code_.code[size - 1];
+    const Instruction& load = first.op == Opcode::Load ? first : second;
+    const Instruction& push = first.op == Opcode::Load ? second : first;
+    if (load.op != Opcode::Load || push.op != Opcode::Push) {
+        return false;
+    }
+    for (const Induction& induction : inductions_) {
+        if (induction.variable != static_cast<uint32_t>(load.a)) {
+            continue;
+        }
+        for (const std::pair<int, uint32_t>& product : induction.products) {
+            if (product.first == push.a) {
+                uint32_t slot = product.second;
+                code_.code.resize(size - 2);
+                depth_ -= 2;
+                emit(Opcode::Load, slot);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+* n DIV 2 ** shift for 0 < shift < 32, rounding toward zero: a negative n
+* is biased by 2 ** shift - 1 before the arithmetic shift.
+*/
+static int32_t divideByPowerOfTwo(int32_t n, int32_t shift) {
+    int32_t bias = static_cast<int32_t>(static_cast<uint32_t>(n >> 31) >> (32 - shift));
+    return (n + bias) >> shift;
+}
+
+bool BytecodeCompiler::reduceByConstant(TokenType op) {
+    std::vector<Instruction>& code = code_.code;
+    size_t size = code.size();
+    // the right operand, or for MUL a left one before a leaf
+    size_t literal = size - 1;
+    if (code[literal].op != Opcode::Push) {
+        if (op != TokenType::MUL || size < 2 || code[size - 2].op != Opcode::Push
+                || (code[size - 1].op != Opcode::Load && code[size - 1].op != Opcode::Push)) {
+            return false;
+        }
+        literal = size - 2;
+    }
+    int32_t k = code[literal].a;
+    bool negative = k < 0;
+    uint32_t magnitude = negative ? 0u - static_cast<uint32_t>(k) : k;
+    bool power = magnitude != 0 && (magnitude & (magnitude - 1)) == 0;
+    uint32_t shift = power ? __builtin_ctz(magnitude) : 0;
+
+    Instruction replacement{Opcode::Mul};
+    if (op == TokenType::MUL) {
+        if (!power) {
+            return false;
+        }
+        // x * -2 ** 31 wraps to x << 31 like x * 2 ** 31
+        negative &= shift != 31;
+        replacement = {Opcode::Shl, static_cast<int32_t>(shift)};
+    } else {
+        if (magnitude == 0 || k == -1 || k == INT32_MIN) {
+            return false;
+        }
+        if (power) {
+            replacement = {Opcode::DivPow2, static_cast<int32_t>(shift)};
+        } else {
+            DivisionMagic magic = DivisionMagic::of(magnitude);
+            replacement = {Opcode::DivMagic, magic.multiplier, magic.shift};
+        }
+    }
+
+    code.erase(code.begin() + literal);
+    depth_--;
+    // by 1 or -1 only the sign is left to do
+    if (shift != 0 || replacement.op == Opcode::DivMagic) {
+        emit(replacement.op, replacement.a, replacement.b);
+    }
+    if (negative) {
+        emit(Opcode::Neg);
+    }
+    return true;
+}
+
+static bool storeThenLoad(Instruction* window) {
+    if (window[0].op != Opcode::Store || window[1].op != Opcode::Load || window[0].a != window[1].a) {
+        return false;
+    }
+    window[0].op = Opcode::Tee;
+    window[1] = {Opcode::Nop};
+    return true;
+}
+
+static bool negatePush(Instruction* window) {
+    if (window[0].op != Opcode::Push || window[1].op != Opcode::Neg) {
+        return false;
+    }
+    window[0].a = static_cast<int32_t>(0u - static_cast<uint32_t>(window[0].a));
+    window[1] = {Opcode::Nop};
+    return true;
+}
+
+static bool negateTwice(Instruction* window) {
+    if (window[0].op != Opcode::Neg || window[1].op != Opcode::Neg) {
+        return false;
+    }
+    window[0] = window[1] = {Opcode::Nop};
+    return true;
+}
+
+static bool foldConstants(Instruction* window) {
+    if (window[0].op != Opcode::Push || window[1].op != Opcode::Push) {
+        return false;
+    }
+    TokenType op;
+    switch (window[2].op) {
+    case Opcode::Add:
+        op = TokenType::PLUS;
+        break;
+    case Opcode::Sub:
+        op = TokenType::MINUS;
+        break;
+    case Opcode::Mul:
+        op = TokenType::MUL;
+        break;
+    default:
+        return false;
+    }
+    window[0].a = applyBinary(op, window[0].a, window[1].a, 0);
+    window[1] = window[2] = {Opcode::Nop};
+    return true;
+}
+
+static bool foldUnary(Instruction* window) {
+    if (window[0].op != Opcode::Push) {
+        return false;
+    }
+    int32_t n = window[0].a;
+    switch (window[1].op) {
+    case Opcode::Shl:
+        window[0].a = static_cast<int32_t>(static_cast<uint32_t>(n) << window[1].a);
+        break;
+    case Opcode::DivPow2:
+        window[0].a = divideByPowerOfTwo(n, window[1].a);
+        break;
+    case Opcode::DivMagic:
+        window[0].a = DivisionMagic{window[1].a, window[1].b}.divide(n);
+        break;
+    default:
+        return false;
+    }
+    window[1] = {Opcode::Nop};
+    return true;
+}
+
+static bool isJump(Opcode op) {
+    return op == Opcode::JumpIfFalse || op == Opcode::Loop || op == Opcode::Next;
+}
+
+const std::vector<PeepholeOptimizer::Rule>& PeepholeOptimizer::standardRules() {
+    static const std::vector<Rule> RULES = {
+        {"store-load", 2, storeThenLoad},
+        {"negate-push", 2, negatePush},
+        {"negate-twice", 2, negateTwice},
+        {"fold", 3, foldConstants},
+        {"fold-unary", 2, foldUnary},
+    };
+    return RULES;
+}
+
+PeepholeOptimizer& PeepholeOptimizer::standard() {
+    static PeepholeOptimizer optimizer;
+    return optimizer;
+}
+
+PeepholeOptimizer::PeepholeOptimizer(const std::vector<Rule>& rules, size_t maxWindow) {
+    for (const Rule& rule : rules) {
+        if (rule.window <= maxWindow) {
+            rules_.push_back(rule);
+        }
+    }
+    applied_ = std::make_unique<std::atomic<size_t>[]>(rules_.size());
+}
+
+void PeepholeOptimizer::run(Bytecode& code) {
+    std::vector<Instruction>& instructions = code.code;
+    before_.fetch_add(instructions.size(), std::memory_order_relaxed);
+    for (bool changed = true; changed; ) {
+        changed = false;
+        std::vector<bool> target(instructions.size() + 1);
+        for (const Instruction& ins : instructions) {
+            if (isJump(ins.op)) {
+                target[ins.a] = true;
+            }
+        }
+        for (size_t i = 0; i < instructions.size(); i++) {
+            for (size_t r = 0; r < rules_.size(); r++) {
+                size_t end = i + rules_[r].window;
+                if (end > instructions.size()) {
+                    continue;
+                }
+                bool open = instructions[i].op != Opcode::Nop;
+                for (size_t j = i + 1; j < end && open; j++) {
+                    open = !target[j] && instructions[j].op != Opcode::Nop;
+                }
+                if (open && rules_[r].rewrite(&instructions[i])) {
+                    applied_[r].fetch_add(1, std::memory_order_relaxed);
+                    changed = true;
+                }
+            }
+        }
+        if (changed) {
+            compact(code);
+        }
+    }
+    after_.fetch_add(instructions.size(), std::memory_order_relaxed);
+}
+
+void PeepholeOptimizer::compact(Bytecode& code) {
+    std::vector<Instruction>& instructions = code.code;
+    // new index of every instruction, a dropped one moves to the next kept
+    std::vector<uint32_t> index(instructions.size() + 1);
+    uint32_t kept = 0;
+    for (size_t i = 0; i < instructions.size(); i++) {
+        index[i] = kept;
+        if (instructions[i].op != Opcode::Nop) {
+            instructions[kept++] = instructions[i];
+        }
+    }
+    index[instructions.size()] = kept;
+    instructions.resize(kept);
+    for (Instruction& ins : instructions) {
+        if (isJump(ins.op)) {
+            ins.a = index[ins.a];
+        }
+    }
+}
+
+PeepholeOptimizer::Statistics PeepholeOptimizer::statistics() const {
+    Statistics result;
+    result.before = before_.load(std::memory_order_relaxed);
+    result.after = after_.load(std::memory_order_relaxed);
+    for (size_t r = 0; r < rules_.size(); r++) {
+        result.applied.push_back(applied_[r].load(std::memory_order_relaxed));
+    }
+    return result;
+}
+
+void Interpreter::execute(const Bytecode& code, std::initializer_list<int> entry) {
+    std::vector<int> slots(code.slots.size());
+    std::vector<uint8_t> defined(code.slots.size());
+    auto readSlots = [this, &code, &slots, &defined]() {
+        for (size_t i = 0; i < code.slots.size(); i++) {
+            if (code.slots[i] == NO_ATOM) {
+                defined[i] = true;
+                continue;
+            }
+            int* value = GLOBAL_SCOPE.find(code.slots[i]);
+            defined[i] = value != nullptr;
+            slots[i] = defined[i] ? *value : 0;
+        }
+    };
+    auto writeSlots = [this, &code, &slots, &defined]() {
+        for (size_t i = 0; i < code.slots.size(); i++) {
+            if (defined[i] && code.slots[i] != NO_ATOM) {
+                GLOBAL_SCOPE[code.slots[i]] = slots[i];
+            }
+        }
+    };
+
+    readSlots();
+    std::copy(entry.begin(), entry.end(), slots.begin());
+    std::vector<int> stack(code.maxStack);
+    int* sp = stack.data();     // next free entry
+    const Instruction* program = code.code.data();
+    const Instruction* pc = program;
+    try {
+        for (;;) {
+            const Instruction& ins = *pc++;
+            switch (ins.op) {
+            case Opcode::Push:
+                *sp++ = ins.a;
+                break;
+            case Opcode::Load:
+                if (!defined[ins.a]) {
+                    throw std::runtime_error("variable not defined");
+                }
+                *sp++ = slots[ins.a];
+                break;
+            case Opcode::Store:
+                slots[ins.a] = *--sp;
+                defined[ins.a] = true;
+                break;
+            case Opcode::Tee:
+                slots[ins.a] = sp[-1];
+                defined[ins.a] = true;
+                break;
+            case Opcode::Nop:
+                break;
+            case Opcode::Neg:
+                sp[-1] = -sp[-1];
+                break;
+            case Opcode::Add:
+                sp--;
+                sp[-1] = sp[-1] + sp[0];
+                break;
+            case Opcode::Sub:
+                sp--;
+                sp[-1] = sp[-1] - sp[0];
+                break;
+            case Opcode::Mul:
+                sp--;
+                sp[-1] = sp[-1] * sp[0];
+                break;
+            case Opcode::Div:
+                sp--;
+                sp[-1] = checkedDivide(sp[-1], sp[0], ins.a);
+                break;
+            case Opcode::FloatDiv:
+                sp--;
+                sp[-1] = (float)sp[-1] / (float)sp[0];
+                break;
+            case Opcode::Shl:
+                sp[-1] = static_cast<int>(static_cast<uint32_t>(sp[-1]) << ins.a);
+                break;
+            case Opcode::DivPow2:
+                sp[-1] = divideByPowerOfTwo(sp[-1], ins.a);
+                break;
+            case Opcode::DivMagic:
+                sp[-1] = DivisionMagic{ins.a, ins.b}.divide(sp[-1]);
+                break;
+            case Opcode::Equal:
+                sp--;
+                sp[-1] = sp[-1] == sp[0];
+                break;
+            case Opcode::NotEqual:
+                sp--;
+                sp[-1] = sp[-1] != sp[0];
+                break;
+            case Opcode::Less:
+                sp--;
+                sp[-1] = sp[-1] < sp[0];
+                break;
+            case Opcode::LessEqual:
+                sp--;
+                sp[-1] = sp[-1] <= sp[0];
+                break;
+            case Opcode::Greater:
+                sp--;
+                sp[-1] = sp[-1] > sp[0];
+                break;
+            case Opcode::GreaterEqual:
+                sp--;
+                sp[-1] = sp[-1] >= sp[0];
+                break;
+            case Opcode::JumpIfFalse:
+                if (*--sp == 0) {
+                    pc = program + ins.a;
+                }
+                break;
+            case Opcode::Loop: {
+                const Bytecode::LoopCost& cost = code.loops[ins.b];
+                statementsExecuted_.fetch_add(cost.statements, std::memory_order_relaxed);
+                charge(cost.steps, cost.loop);
+                pc = program + ins.a;
+                break;
+            }
+            case Opcode::Next: {
+                const Bytecode::LoopCost& cost = code.loops[ins.b];
+                statementsExecuted_.fetch_add(cost.statements, std::memory_order_relaxed);
+                charge(cost.steps, cost.loop);
+                int& counter = slots[cost.counter];
+                if (counter != slots[cost.counter + 1]) {
+                    counter++;
+                    pc = program + ins.a;
+                }
+                break;
+            }
+            case Opcode::Step:
+                slots[ins.a] = static_cast<int>(static_cast<uint32_t>(slots[ins.a]) + static_cast<uint32_t>(ins.b));
+                break;
+            case Opcode::Call:
+                writeSlots();
+                visit(*code.calls[ins.a]);
+                readSlots();
+                break;
+            case Opcode::Exit:
+                writeSlots();
+                return;
+            }
+        }
+    } catch (...) {
+        writeSlots();
+        throw;
+    }
+}
+
+std::string ASTSerializer::serialize(Program& prog) {
+    image_.assign(sizeof(ImageHeader), '\0');
+    uint32_t root = write(&prog);
+
+    uint32_t tableOffset = image_.size();
+    putU32(strings_.size());
+    uint32_t bytesOffset = tableOffset + sizeof(uint32_t) * (1 + 2 * strings_.size());
+    for (const std::string* str : strings_) {
+        putU32(bytesOffset);
+        putU32(str->size());
+        bytesOffset += str->size();
+    }
+    for (const std::string* str : strings_) {
+        image_ += *str;
+    }
+
+    ImageHeader header;
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(header.magic));
+    header.version = IMAGE_VERSION;
+    header.rootOffset = root;
+    header.stringTableOffset = tableOffset;
+    header.imageSize = image_.size();
+    memcpy(&image_[0], &header, sizeof(header));
+
+    written_.clear();
+    strings_.clear();
+    stringIndex_.clear();
+    return std::move(image_);
+}
+
+uint32_t ASTSerializer::write(AST* node) {
+    auto it = written_.find(node);
+    if (it != written_.end()) {
+        NodeHeader header;
+        memcpy(&header, &image_[it->second], sizeof(header));
+        header.flags |= NODE_SHARED;
+        memcpy(&image_[it->second], &header, sizeof(header));
+        return it->second;
+    }
+    node->accept(*this);
+    written_[node] = lastOffset_;
+    return lastOffset_;
+}
+
+uint32_t ASTSerializer::beginNode(AST& node, NodeKind kind, TokenType op) {
+    NodeHeader header{kind, static_cast<uint8_t>(op), 0, node.offset_};
+    uint32_t offset = image_.size();
+    image_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    lastOffset_ = offset;
+    return offset;
+}
+
+void ASTSerializer::putU32(uint32_t value) {
+    image_.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void ASTSerializer::putChild(uint32_t childOffset) {
+    int32_t relative = static_cast<int32_t>(childOffset) - static_cast<int32_t>(image_.size());
+    putU32(static_cast<uint32_t>(relative));
+}
+
+uint32_t ASTSerializer::stringIndex(const std::string& str) {
+    auto iter = stringIndex_.insert(std::make_pair(str, strings_.size()));
+    if (iter.second) {
+        strings_.push_back(&iter.first->first);
+    }
+    return iter.first->second;
+}
+
+void ASTSerializer::visit(Program& prog) {
+    uint32_t blk = write(prog.block_);
+    beginNode(prog, NodeKind::Program, TokenType::Program);
+    putU32(stringIndex(Interner::name(prog.name_)));
+    putChild(blk);
+}
+
+void ASTSerializer::visit(Block& blk) {
+    std::vector<uint32_t> decls;
+    for (AST* decl : blk.declarations_) {
+        decls.push_back(write(decl));
+    }
+    uint32_t comp = write(blk.compoundStatement_);
+    beginNode(blk, NodeKind::Block, TokenType::Begin);
+    putU32(decls.size());
+    for (uint32_t decl : decls) {
+        putChild(decl);
+    }
+    putChild(comp);
+}
+
+void ASTSerializer::visit(VarDecl& vDecl) {
+    uint32_t var = write(vDecl.varNode_);
+    uint32_t type = write(vDecl.typeNode_);
+    beginNode(vDecl, NodeKind::VarDecl, TokenType::Var);
+    putChild(var);
+    putChild(type);
+}
+
+void ASTSerializer::visit(Type& tp) {
+    beginNode(tp, NodeKind::Type, tp.token_.type_);
+    putU32(stringIndex(Interner::name(tp.value_)));
+}
+
+void ASTSerializer::visit(ProcedureDecl& pd) {
+    uint32_t blk = write(pd.body());
+    beginNode(pd, NodeKind::ProcedureDecl, TokenType::Procedure);
+    putU32(stringIndex(Interner::name(pd.name_)));
+    putChild(blk);
+}
+
+void ASTSerializer::visit(ProcedureCall& pc) {
+    beginNode(pc, NodeKind::ProcedureCall, TokenType::ID);
+    putU32(stringIndex(Interner::name(pc.procName_)));
+}
+
+void ASTSerializer::visit(While& loop) {
+    uint32_t condition = write(loop.condition_);
+    uint32_t body = write(loop.body_);
+    beginNode(loop, NodeKind::While, TokenType::While);
+    putChild(condition);
+    putChild(body);
+}
+
+void ASTSerializer::visit(For& loop) {
+    uint32_t variable = write(loop.variable_);
+    uint32_t from = write(loop.from_);
+    uint32_t to = write(loop.to_);
+    uint32_t body = write(loop.body_);
+    beginNode(loop, NodeKind::For, TokenType::For);
+    putChild(variable);
+    putChild(from);
+    putChild(to);
+    putChild(body);
+}
+
+void ASTSerializer::visit(Compound& comp) {
+    std::vector<uint32_t> children;
+    for (AST* child : comp.children_) {
+        children.push_back(write(child));
+    }
+    beginNode(comp, NodeKind::Compound, TokenType::Begin);
+    putU32(children.size());
+    for (uint32_t child : children) {
+        putChild(child);
+    }
+}
+
+void ASTSerializer::visit(Assign& as) {
+    uint32_t left = write(as.left_);
+    uint32_t right = write(as.right_);
+    beginNode(as, NodeKind::Assign, as.op_.type_);
+    putChild(left);
+    putChild(right);
+}
+
+int ASTSerializer::visit(Var& var) {
+    beginNode(var, NodeKind::Var, var.token_.type_);
+    putU32(stringIndex(Interner::name(var.value_)));
+    return 0;
+}
+
+void ASTSerializer::visit(NoOp& noop) {
+    beginNode(noop, NodeKind::NoOp, TokenType::TYPE_EOF);
+}
+
+int ASTSerializer::visit(BinOp& bo) {
+    ExpressionDepth depth;
+    if (depth.exceeded()) {
+        writeIteratively(bo);
+        return 0;
+    }
+    uint32_t left = write(bo.left_);
+    uint32_t right = write(bo.right_);
+    beginNode(bo, NodeKind::BinOp, bo.op_.type_);
+    putChild(left);
+    putChild(right);
+    return 0;
+}
+
+int ASTSerializer::visit(UnaryOp& uo) {
+    ExpressionDepth depth;
+    if (depth.exceeded()) {
+        writeIteratively(uo);
+        return 0;
+    }
+    uint32_t expr = write(uo.expr_);
+    beginNode(uo, NodeKind::UnaryOp, uo.op_.type_);
+    putChild(expr);
+    return 0;
+}
+
+void ASTSerializer::writeIteratively(AST& expr) {
+    std::vector<uint32_t> offsets;
+    walkExpression(expr, [this, &offsets](AST& leaf) {
+        offsets.push_back(write(&leaf));
+    }, [this, &offsets](UnaryOp& uo) {
+        uint32_t operand = offsets.back();
+        offsets.back() = beginNode(uo, NodeKind::UnaryOp, uo.op_.type_);
+        putChild(operand);
+    }, [this, &offsets](BinOp& bo) {
+        uint32_t right = offsets.back();
+        offsets.pop_back();
+        uint32_t left = offsets.back();
+        offsets.back() = beginNode(bo, NodeKind::BinOp, bo.op_.type_);
+        putChild(left);
+        putChild(right);
+    });
+    // the root is the last node begun, write() records it
+}
+
+int ASTSerializer::visit(Num& num) {
+    beginNode(num, NodeKind::Num, num.token_.type_);
+    putU32(stringIndex(num.value_));
+    return 0;
+}
+
+Program* ASTLoader::load() {
+    ImageHeader header;
+    if (size_ < sizeof(header)) {
+        error();
+    }
+    memcpy(&header, data_, sizeof(header));
+    if (memcmp(header.magic, IMAGE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.version != IMAGE_VERSION || header.imageSize > size_) {
+        error();
+    }
+    size_ = header.imageSize;
+
+    uint32_t count = u32(header.stringTableOffset);
+    if (count > (size_ - header.stringTableOffset) / (2 * sizeof(uint32_t))) {
+        error();
+    }
+    strings_.reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t entry = header.stringTableOffset + sizeof(uint32_t) * (1 + 2 * i);
+        uint32_t offset = u32(entry);
+        uint32_t length = u32(entry + sizeof(uint32_t));
+        if (offset > size_ || length > size_ - offset) {
+            error();
+        }
+        strings_.emplace_back(data_ + offset, length);
+    }
+
+    atoms_.assign(count, NO_ATOM);
+    loaded_.assign(size_, false);
+
+    if (header.rootOffset < sizeof(header)) {
+        error();
+    }
+    Program* prog = node<Program>(header.rootOffset, NodeKind::Program);
+    shared_.clear();
+    loaded_.clear();
+    return prog;
+}
+
+uint32_t ASTLoader::u32(uint32_t offset) {
+    uint32_t value;
+    if (offset > size_ || sizeof(value) > size_ - offset) {
+        error();
+    }
+    memcpy(&value, data_ + offset, sizeof(value));
+    return value;
+}
+
+uint32_t ASTLoader::child(uint32_t parent, uint32_t fieldOffset) {
+    int64_t target = static_cast<int64_t>(fieldOffset) + static_cast<int32_t>(u32(fieldOffset));
+    // children come first, so following them always ends
+    if (target < static_cast<int64_t>(sizeof(ImageHeader)) || target >= parent) {
+        error();
+    }
+    return static_cast<uint32_t>(target);
+}
+
+void ASTLoader::claim(uint32_t offset, const NodeHeader& header) {
+    // only a shared node may be reached twice, anything else could blow up a small image
+    if (!(header.flags & NODE_SHARED)) {
+        if (loaded_[offset]) {
+            error();
+        }
+        loaded_[offset] = true;
+    }
+}
+
+std::string& ASTLoader::string(uint32_t index) {
+    if (index >= strings_.size()) {
+        error();
+    }
+    return strings_[index];
+}
+
+Token ASTLoader::token(uint32_t nodeOffset, uint32_t stringField) {
+    NodeHeader header;
+    memcpy(&header, data_ + nodeOffset, sizeof(header));
+    return Token(static_cast<TokenType>(header.op), string(u32(stringField)));
+}
+
+Atom ASTLoader::atom(uint32_t index) {
+    std::string& str = string(index);
+    if (atoms_[index] == NO_ATOM) {
+        atoms_[index] = Interner::intern(str);
+    }
+    return atoms_[index];
+}
+
+Token ASTLoader::atomToken(uint32_t nodeOffset, uint32_t stringField) {
+    NodeHeader header;
+    memcpy(&header, data_ + nodeOffset, sizeof(header));
+    TokenType type = static_cast<TokenType>(header.op);
+    uint32_t index = u32(stringField);
+    if (type == TokenType::ID) {
+        return Token(type, atom(index));
+    }
+    return Token(type, string(index), atom(index));
+}
+
+Token ASTLoader::opToken(uint32_t nodeOffset) {
+    NodeHeader header;
+    memcpy(&header, data_ + nodeOffset, sizeof(header));
+    TokenType type = static_cast<TokenType>(header.op);
+    switch (type) {
+        case TokenType::PLUS:       return Token(type, "+");
+        case TokenType::MINUS:      return Token(type, "-");
+        case TokenType::MUL:        return Token(type, "*");
+        case TokenType::IntegerDiv: return Token(type, "DIV");
+        case TokenType::FloatDiv:   return Token(type, "/");
+        case TokenType::Assign:     return Token(type, ":=");
+        case TokenType::Equal:      return Token(type, "=");
+        case TokenType::NotEqual:   return Token(type, "<>");
+        case TokenType::Less:       return Token(type, "<");
+        case TokenType::LessEqual:  return Token(type, "<=");
+        case TokenType::Greater:    return Token(type, ">");
+        case TokenType::GreaterEqual: return Token(type, ">=");
+        default:
+            error();
+    }
+    return Token(type, "");
+}
+
+template <typename T>
+T* ASTLoader::node(uint32_t offset, NodeKind kind) {
+    AST* result = node(offset);
+    NodeHeader header;
+    memcpy(&header, data_ + offset, sizeof(header));
+    if (header.kind != kind) {
+        error();
+    }
+    return static_cast<T*>(result);
+}
+
+NodeHeader ASTLoader::header(uint32_t offset) {
+    NodeHeader header;
+    if (offset > size_ || sizeof(header) > size_ - offset) {
+        error();
+    }
+    memcpy(&header, data_ + offset, sizeof(header));
+    return header;
+}
+
+AST* ASTLoader::finish(AST* result, uint32_t offset, const NodeHeader& header) {
+    result->offset_ = header.source;
+    if (header.flags & NODE_SHARED) {
+        shared_[offset] = result;
+    }
+    return result;
+}
+
+AST* ASTLoader::node(uint32_t offset) {
+    if (depth_ == MAX_DEPTH) {
+        error();
+    }
+    depth_++;
+    AST* result = build(offset);
+    depth_--;
+    return result;
+}
+
+AST* ASTLoader::build(uint32_t offset) {
+    NodeHeader header = this->header(offset);
+    if (header.flags & NODE_SHARED) {
+        auto it = shared_.find(offset);
+        if (it != shared_.end()) {
+            return it->second;
+        }
+    }
+    claim(offset, header);
+
+    uint32_t field = offset + sizeof(header);
+
+    AST* result = nullptr;
+    switch (header.kind) {
+        case NodeKind::Program: {
+            Block* blk = node<Block>(child(offset, field + 4), NodeKind::Block);
+            result = new Program(atom(u32(field)), blk);
+            break;
+        }
+        case NodeKind::Block: {
+            std::list<AST*> decls;
+            uint32_t count = u32(field);
+            for (uint32_t i = 0; i < count; i++) {
+                decls.push_back(node(child(offset, field + 4 + 4 * i)));
+            }
+            Compound* comp = node<Compound>(child(offset, field + 4 + 4 * count), NodeKind::Compound);
+            result = new Block(decls, comp);
+            break;
+        }
+        case NodeKind::VarDecl: {
+            Var* var = node<Var>(child(offset, field), NodeKind::Var);
+            Type* type = node<Type>(child(offset, field + 4), NodeKind::Type);
+            result = new VarDecl(var, type);
+            break;
+        }
+        case NodeKind::Type: {
+            Token tk = atomToken(offset, field);
+            result = new Type(tk);
+            break;
+        }
+        case NodeKind::ProcedureDecl: {
+            Block* blk = node<Block>(child(offset, field + 4), NodeKind::Block);
+            result = new ProcedureDecl(atom(u32(field)), blk);
+            break;
+        }
+        case NodeKind::Compound: {
+            Compound* comp = new Compound();
+            uint32_t count = u32(field);
+            for (uint32_t i = 0; i < count; i++) {
+                comp->children_.push_back(node(child(offset, field + 4 + 4 * i)));
+            }
+            result = comp;
+            break;
+        }
+        case NodeKind::Assign: {
+            Token op = opToken(offset);
+            Var* left = node<Var>(child(offset, field), NodeKind::Var);
+            result = new Assign(left, op, node(child(offset, field + 4)));
+            break;
+        }
+        case NodeKind::Var: {
+            Token tk = atomToken(offset, field);
+            result = new Var(tk);
+            break;
+        }
+        case NodeKind::ProcedureCall: {
+            Token tk = atomToken(offset, field);
+            result = new ProcedureCall(tk);
+            break;
+        }
+        case NodeKind::While: {
+            AST* condition = node(child(offset, field));
+            result = new While(condition, node(child(offset, field + 4)));
+            break;
+        }
+        case NodeKind::For: {
+            Var* variable = node<Var>(child(offset, field), NodeKind::Var);
+            AST* from = node(child(offset, field + 4));
+            AST* to = node(child(offset, field + 8));
+            result = new For(variable, from, to, node(child(offset, field + 12)));
+            break;
+        }
+        case NodeKind::NoOp:
+            result = new NoOp();
+            break;
+        case NodeKind::BinOp: {
+            ExpressionDepth depth;
+            if (depth.exceeded()) {
+                return expression(offset);
+            }
+            Token op = opToken(offset);
+            AST* left = node(child(offset, field));
+            result = new BinOp(left, op, node(child(offset, field + 4)));
+            break;
+        }
+        case NodeKind::UnaryOp: {
+            ExpressionDepth depth;
+            if (depth.exceeded()) {
+                return expression(offset);
+            }
+            Token op = opToken(offset);
+            result = new UnaryOp(op, node(child(offset, field)));
+            break;
+        }
+        case NodeKind::Num: {
+            Token tk = token(offset, field);
+            result = new Num(tk);
+            break;
+        }
+        default:
+            error();
+    }
+    return finish(result, offset, header);
+}
+
+AST* ASTLoader::expression(uint32_t root) {
+    // like walkExpression, over image offsets
+    std::vector<std::pair<uint32_t, bool>> stack{{root, false}};
+    std::vector<AST*> values;
+    while (!stack.empty()) {
+        auto [offset, expanded] = stack.back();
+        stack.pop_back();
+        NodeHeader header = this->header(offset);
+        bool loaded = (header.flags & NODE_SHARED) && shared_.count(offset) != 0;
+        if (loaded || (header.kind != NodeKind::BinOp && header.kind != NodeKind::UnaryOp)) {
+            values.push_back(node(offset));
+            continue;
+        }
+
+        uint32_t field = offset + sizeof(header);
+        if (!expanded) {
+            claim(offset, header);
+            stack.push_back({offset, true});
+            if (header.kind == NodeKind::BinOp) {
+                stack.push_back({child(offset, field + 4), false});
+            }
+            stack.push_back({child(offset, field), false});
+            continue;
+        }
+        Token op = opToken(offset);
+        AST* result;
+        if (header.kind == NodeKind::BinOp) {
+            AST* right = values.back();
+            values.pop_back();
+            result = new BinOp(values.back(), op, right);
+        } else {
+            result = new UnaryOp(op, values.back());
+        }
+        values.back() = finish(result, offset, header);
+    }
+    return values.back();
+}
+
+static bool readFile(const std::string& filepath, std::string& content) {
+    if (filepath == "-") {
+        content.assign((std::istreambuf_iterator<char>(std::cin)), std::istreambuf_iterator<char>());
+        return true;
+    }
+    std::ifstream file(filepath, std::ios::binary);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << filepath << std::endl;
+        return false;
+    }
+    file.seekg(0, std::ios::end);
+    content.resize(file.tellg());
+    file.seekg(0, std::ios::beg);
+    file.read(&content[0], content.size());
+    return true;
+}
+
+static Program* parseText(std::string text) {
+    std::unique_ptr<Lexer> lexer = std::make_unique<Lexer>(std::move(text));
+    Parser parser(std::move(lexer));
+    return static_cast<Program*>(parser.parse());
+}
+
+/*
+* Parse a source file and write its binary image.
+*/
+static int serializeFile(const std::string& srcPath, const std::string& imagePath) {
+    std::string content;
+    if (!readFile(srcPath, content)) {
+        return 1;
+    }
+    Program* prog;
+    try {
+        prog = parseText(std::move(content));
+    } catch (const SourceError& e) {
+        std::cerr << SourceMap::fromFile(srcPath).format(e.offset()) << ": " << e.what() << std::endl;
+        return 1;
+    }
+    std::string image = ASTSerializer().serialize(*prog);
+
+    std::ofstream out(imagePath, std::ios::binary);
+    if (!out.is_open()) {
+        std::cerr << "Failed to open file: " << imagePath << std::endl;
+        return 1;
+    }
+    out.write(image.data(), image.size());
+    return 0;
+}
+
+/*
+* Map a binary image into memory and run it without touching the lexer or parser.
+*/
+static int runImage(const std::string& imagePath) {
+    int fd = open(imagePath.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::cerr << "Failed to open file: " << imagePath << std::endl;
+        return 1;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "Failed to map file: " << imagePath << std::endl;
+        return 1;
+    }
+
+    Program* prog;
+    try {
+        prog = ASTLoader(static_cast<const char*>(data), st.st_size).load();
+    } catch (const std::exception& e) {
+        munmap(data, st.st_size);
+        std::cerr << "Failed to load " << imagePath << ": " << e.what() << std::endl;
+        return 1;
+    }
+    munmap(data, st.st_size);
+
+    Interpreter interp;
+    try {
+        interp.interpret(prog);
+    } catch (const std::exception& e) {
+        // no source text to show a line of, the offset is in the program it was made from
+        std::cerr << imagePath << ": " << e.what() << std::endl;
+        return 1;
+    }
+    interp.printGlobalScope();
+    return 0;
+}
+
+/*
+* Check that text -> image -> tree -> image is stable and compare
+* the size and the time to get a tree from either representation.
+*/
+static int compareBinary(const std::string& srcPath) {
+    const int rounds = 20;
+    std::string content;
+    if (!readFile(srcPath, content)) {
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Program* prog = nullptr;
+    for (int i = 0; i < rounds; i++) {
+        prog = parseText(content);
+    }
+    auto parseTime = std::chrono::steady_clock::now() - start;
+
+    std::string image = ASTSerializer().serialize(*prog);
+
+    start = std::chrono::steady_clock::now();
+    Program* loaded = nullptr;
+    for (int i = 0; i < rounds; i++) {
+        loaded = ASTLoader(image.data(), image.size()).load();
+    }
+    auto loadTime = std::chrono::steady_clock::now() - start;
+
+    bool same = ASTSerializer().serialize(*loaded) == image;
+
+    using us = std::chrono::microseconds;
+    std::cout << "text:   " << content.size() << " bytes, parse "
+              << std::chrono::duration_cast<us>(parseTime).count() / rounds << " us" << std::endl;
+    std::cout << "binary: " << image.size() << " bytes, load "
+              << std::chrono::duration_cast<us>(loadTime).count() / rounds << " us" << std::endl;
+    std::cout << "round-trip: " << (same ? "ok" : "MISMATCH") << std::endl;
+    return same ? 0 : 1;
+}
+
+std::shared_ptr<CachedProgram> ProgramCache::find(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(id);
+    if (it == index_.end()) {
+        return nullptr;
+    }
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return it->second->second;
+}
+
+void ProgramCache::insert(const std::string& id, std::shared_ptr<CachedProgram> program) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(id);
+    if (it != index_.end()) {
+        // parsed concurrently by two requests, keep the first
+        entries_.splice(entries_.begin(), entries_, it->second);
+        return;
+    }
+    entries_.emplace_front(id, std::move(program));
+    index_[id] = entries_.begin();
+    if (entries_.size() > capacity_) {
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+    }
+}
+
+static std::string programId(const std::string& text) {
+    // FNV-1a, 64 bit
+    uint64_t h = 14695981039346656037ull;
+    for (char c : text) {
+        h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    char id[17];
+    snprintf(id, sizeof(id), "%016llx", static_cast<unsigned long long>(h));
+    return id;
+}
+
+static void systemError(const std::string& what) {
+    throw std::runtime_error(what + ": " + strerror(errno));
+}
+
+static sockaddr_un socketAddress(const std::string& socketPath) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + socketPath);
+    }
+    memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+    return addr;
+}
+
+Server::Server(const std::string& socketPath, ThreadPool& pool, const ExecutionLimits& limits)
+    : socketPath_(socketPath), pool_(pool), limits_(limits), cache_(CACHE_CAPACITY) {
+    sockaddr_un addr = socketAddress(socketPath);
+    listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd_ < 0) {
+        systemError("socket");
+    }
+    // a stale socket file of an earlier run would make bind fail
+    unlink(socketPath.c_str());
+    if (bind(listenFd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        systemError("bind " + socketPath);
+    }
+    if (listen(listenFd_, SOMAXCONN) < 0) {
+        systemError("listen");
+    }
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd_ < 0) {
+        systemError("epoll_create1");
+    }
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeFd_ < 0) {
+        systemError("eventfd");
+    }
+    watch(listenFd_, EPOLLIN);
+    watch(wakeFd_, EPOLLIN);
+}
+
+Server::~Server() {
+    // tasks touch us until they leave doneMutex_ for the last time
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(doneMutex_);
+            if (inFlight_ == 0) {
+                break;
+            }
+        }
+        std::this_thread::yield();
+    }
+    for (auto& entry : connections_) {
+        close(entry.first);
+    }
+    for (int fd : {listenFd_, epollFd_, wakeFd_}) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (listenFd_ >= 0) {
+        unlink(socketPath_.c_str());
+    }
+}
+
+void Server::run() {
+    epoll_event events[64];
+    // a connection only goes away once answered, the destructor waits for the tasks to let go of us
+    while (!stopping_ || !connections_.empty()) {
+        int n = epoll_wait(epollFd_, events, 64, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            systemError("epoll_wait");
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listenFd_) {
+                acceptAll();
+            } else if (fd == wakeFd_) {
+                completeAll();
+            } else if (connections_.count(fd) != 0) {
+                if (connections_[fd].out.empty()) {
+                    readFrom(fd);
+                } else {
+                    writeTo(fd);
+                }
+            }
+        }
+    }
+}
+
+void Server::watch(int fd, uint32_t events) {
+    epoll_event event{};
+    event.events = events;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+        systemError("epoll_ctl");
+    }
+    if (connections_.count(fd) != 0) {
+        connections_[fd].watched = true;
+    }
+}
+
+void Server::unwatch(int fd) {
+    Connection& conn = connections_[fd];
+    if (conn.watched) {
+        epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, nullptr);
+        conn.watched = false;
+    }
+}
+
+void Server::closeConnection(int fd) {
+    close(fd);
+    connections_.erase(fd);
+}
+
+void Server::acceptAll() {
+    while (true) {
+        int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                std::cerr << "accept: " << strerror(errno) << std::endl;
+            }
+            return;
+        }
+        if (stopping_) {
+            close(fd);
+            continue;
+        }
+        connections_[fd];
+        watch(fd, EPOLLIN);
+    }
+}
+
+void Server::readFrom(int fd) {
+    Connection& conn = connections_[fd];
+    char buffer[64 * 1024];
+    while (true) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            conn.in.append(buffer, n);
+            if (conn.in.size() > MAX_REQUEST) {
+                unwatch(fd);
+                startWrite(fd, "ERROR Request too large\n");
+                return;
+            }
+        } else if (n == 0) {
+            unwatch(fd);
+            dispatch(fd);
+            return;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            closeConnection(fd);
+            return;
+        }
+    }
+}
+
+void Server::dispatch(int fd) {
+    std::string request = std::move(connections_[fd].in);
+    if (request.compare(0, 4, "STOP") == 0) {
+        stopping_ = true;
+        startWrite(fd, "OK\n");
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(doneMutex_);
+        inFlight_++;
+    }
+    pool_.submit([this, fd, request = std::move(request)] {
+        std::string response = handle(request);
+        // the last use of this, the wake included, so a drained answer means the task is done with us
+        std::lock_guard<std::mutex> lock(doneMutex_);
+        done_.emplace_back(fd, std::move(response));
+        uint64_t one = 1;
+        ssize_t unused = write(wakeFd_, &one, sizeof(one));
+        (void)unused;
+        inFlight_--;
+    });
+}
+
+void Server::completeAll() {
+    uint64_t count;
+    ssize_t unused = read(wakeFd_, &count, sizeof(count));
+    (void)unused;
+    std::vector<std::pair<int, std::string>> done;
+    {
+        std::lock_guard<std::mutex> lock(doneMutex_);
+        done.swap(done_);
+    }
+    for (auto& entry : done) {
+        startWrite(entry.first, std::move(entry.second));
+    }
+}
+
+void Server::startWrite(int fd, std::string&& response) {
+    Connection& conn = connections_[fd];
+    conn.out = std::move(response);
+    conn.written = 0;
+    writeTo(fd);
+}
+
+void Server::writeTo(int fd) {
+    Connection& conn = connections_[fd];
+    while (conn.written < conn.out.size()) {
+        ssize_t n = send(fd, conn.out.data() + conn.written, conn.out.size() - conn.written, MSG_NOSIGNAL);
+        if (n >= 0) {
+            conn.written += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (!conn.watched) {
+                watch(fd, EPOLLOUT);
+            }
+            return;
+        } else if (errno != EINTR) {
+            break;
+        }
+    }
+    closeConnection(fd);
+}
+
+std::string Server::handle(const std::string& request) {
+    std::shared_ptr<CachedProgram> program;
+    try {
+        std::string id;
+        if (request.compare(0, 4, "RUN\n") == 0) {
+            std::string text = request.substr(4);
+            id = programId(text);
+            program = cache_.find(id);
+            // the id is no cryptographic hash, a colliding text runs uncached
+            bool collision = program != nullptr && program->text != text;
+            if (program == nullptr || collision) {
+                program = std::make_shared<CachedProgram>(ARENA_LIMIT);
+                program->text = text;
+                Parser parser(std::make_unique<Lexer>(std::move(text)), false, &program->arena);
+                program->tree = parser.parse();
+                SymbolTableBuilder builder;
+                program->tree->accept(builder);
+                if (!builder.diagnostics().empty()) {
+                    const Diagnostic& diagnostic = builder.diagnostics().front();
+                    throw SourceError(diagnostic.offset, diagnostic.message);
+                }
+                if (!collision) {
+                    cache_.insert(id, program);
+                }
+            }
+        } else if (request.compare(0, 5, "CALL ") == 0) {
+            id = request.substr(5, request.find('\n') - 5);
+            program = cache_.find(id);
+            if (program == nullptr) {
+                return "ERROR Unknown program " + id + "\n";
+            }
+        } else {
+            return "ERROR Bad request\n";
+        }
+
+        Interpreter interp;
+        interp.setLimits(limits_);
+        interp.interpret(program->tree);
+        std::ostringstream response;
+        response << "OK " << id << "\n";
+        interp.printGlobalScope(response);
+        return response.str();
+    } catch (const SourceError& e) {
+        // programs keep their text, so a CALL can show the line as well
+        SourceMap source = program != nullptr ? SourceMap("program", program->text) : SourceMap("program");
+        return "ERROR " + source.format(e.offset()) + ": " + e.what() + "\n";
+    } catch (const std::exception& e) {
+        return std::string("ERROR ") + e.what() + "\n";
+    }
+}
+
+static int runServer(const std::string& socketPath, ThreadPool& pool, const ExecutionLimits& limits) {
+    try {
+        Server server(socketPath, pool, limits);
+        server.run();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+* Send one request to a server. The scope goes to stdout,
+* the program id of a RUN request to stderr.
+*/
+static int runClient(const std::string& socketPath, const std::string& request) {
+    std::string response;
+    try {
+        sockaddr_un addr = socketAddress(socketPath);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            systemError("socket");
+        }
+        std::unique_ptr<int, void (*)(int*)> closer(&fd, [](int* p) { close(*p); });
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            systemError("connect " + socketPath);
+        }
+        for (size_t written = 0; written < request.size(); ) {
+            ssize_t n = send(fd, request.data() + written, request.size() - written, MSG_NOSIGNAL);
+            if (n < 0 && errno == EPIPE) {
+                // the server gave up on the request, its answer says why
+                break;
+            }
+            if (n < 0 && errno != EINTR) {
+                systemError("send");
+            }
+            written += std::max<ssize_t>(n, 0);
+        }
+        shutdown(fd, SHUT_WR);
+        char buffer[64 * 1024];
+        while (true) {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                systemError("read");
+            }
+            if (n == 0) {
+                break;
+            }
+            response.append(buffer, n);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    size_t lineEnd = response.find('\n');
+    std::string status = response.substr(0, lineEnd);
+    if (status.compare(0, 2, "OK") != 0) {
+        std::cerr << (status.empty() ? "ERROR No response" : status) << std::endl;
+        return 1;
+    }
+    if (status.size() > 3) {
+        std::cerr << "program " << status.substr(3) << std::endl;
+    }
+    if (lineEnd != std::string::npos) {
+        std::cout << response.substr(lineEnd + 1) << std::flush;
+    }
+    return 0;
+}
+
+/*
+* Inputs of a parameter sweep: a header line with variable names,
+* then one line of comma separated initial values per instance.
+*/
+static bool readSweepInputs(const std::string& csvPath, std::vector<Atom>& inputs,
+                            std::vector<std::vector<int>>& rows) {
+    std::ifstream file(csvPath);
+    if (!file.is_open()) {
+        std::cerr << "Failed to open file: " << csvPath << std::endl;
+        return false;
+    }
+
+    auto split = [](const std::string& line) {
+        std::vector<std::string> fields;
+        size_t begin = 0;
+        while (begin <= line.size()) {
+            size_t end = std::min(line.find(',', begin), line.size());
+            std::string field = line.substr(begin, end - begin);
+            field.erase(0, field.find_first_not_of(" \t\r"));
+            field.erase(field.find_last_not_of(" \t\r") + 1);
+            fields.push_back(field);
+            begin = end + 1;
+        }
+        return fields;
+    };
+
+    std::string line;
+    if (!std::getline(file, line)) {
+        std::cerr << "Empty input file: " << csvPath << std::endl;
+        return false;
+    }
+    for (const std::string& name : split(line)) {
+        inputs.push_back(Interner::intern(name));
+    }
+    while (std::getline(file, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        std::vector<int> row;
+        for (const std::string& field : split(line)) {
+            size_t used = 0;
+            try {
+                row.push_back(std::stoi(field, &used));
+            } catch (const std::logic_error&) {
+                // invalid_argument or out_of_range
+            }
+            if (used == 0 || used != field.size()) {
+                std::cerr << "Bad value in " << csvPath << ": " << line << std::endl;
+                return false;
+            }
+        }
+        if (row.size() != inputs.size()) {
+            std::cerr << "Wrong number of values in " << csvPath << ": " << line << std::endl;
+            return false;
+        }
+        rows.push_back(std::move(row));
+    }
+    return true;
+}
+
+static void printScope(const LaneInterpreter::Scope& scope, const std::vector<Atom>& only) {
+    std::cout << "{";
+    const char* separator = "";
+    for (const std::pair<Atom, int>& var : scope) {
+        if (!CommonSubexpressions::isTemporary(var.first)
+                && (only.empty() || std::find(only.begin(), only.end(), var.first) != only.end())) {
+            std::cout << separator << Interner::name(var.first) << ": " << var.second;
+            separator = ", ";
+        }
+    }
+    std::cout << "}" << std::endl;
+}
+
+/*
+* Run the program once per line of the CSV, all lanes at once or,
+* as a reference, with one scalar Interpreter per instance.
+*/
+static int runSweep(AST* tree, const std::string& csvPath, bool scalar, const std::vector<Atom>& outputs) {
+    std::vector<Atom> inputs;
+    std::vector<std::vector<int>> rows;
+    if (!readSweepInputs(csvPath, inputs, rows)) {
+        return 1;
+    }
+
+    if (!scalar) {
+        try {
+            for (const LaneInterpreter::Scope& scope : LaneInterpreter().run(tree, inputs, rows)) {
+                printScope(scope, outputs);
+            }
+            return 0;
+        } catch (const LanesDiverged& e) {
+            // nothing is printed before all instances are done
+            std::cerr << "sweep: " << e.what() << ", running the instances one by one" << std::endl;
+        }
+    }
+    for (const std::vector<int>& row : rows) {
+        Interpreter interp;
+        for (size_t i = 0; i < inputs.size(); i++) {
+            interp.setVariable(inputs[i], row[i]);
+        }
+        interp.interpret(tree);
+        interp.printGlobalScope(std::cout, outputs);
+    }
+    return 0;
+}
+
+/*
+* The files of a batch: every regular file below a directory, in name
+* order, or the paths listed one per line in a manifest ('#' comments).
+*/
+static bool listBatch(const std::string& path, std::vector<std::string>& files) {
+    std::error_code ec;
+    if (std::filesystem::is_directory(path, ec)) {
+        for (auto it = std::filesystem::recursive_directory_iterator(path, ec);
+             !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+            if (it->is_regular_file(ec)) {
+                files.push_back(it->path().string());
+            }
+        }
+        if (ec) {
+            std::cerr << "Failed to read directory " << path << ": " << ec.message() << std::endl;
+            return false;
+        }
+        std::sort(files.begin(), files.end());
+        return true;
+    }
+
+    std::ifstream manifest(path);
+    if (!manifest.is_open()) {
+        std::cerr << "Failed to open file: " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(manifest, line)) {
+        line.erase(0, line.find_first_not_of(" \t\r"));
+        line.erase(line.find_last_not_of(" \t\r") + 1);
+        if (!line.empty() && line[0] != '#') {
+            files.push_back(line);
+        }
+    }
+    return true;
+}
+
+/*
+* Run many programs in one process, one task per file on the pool.
+* Each worker keeps an arena that is reset between its files, every
+* file gets a fresh Interpreter. A result line is printed as soon as
+* its file is done, so the output order follows completion.
+*/
+static int runBatch(const std::string& path, ThreadPool& pool, bool check, const ExecutionLimits& limits) {
+    std::vector<std::string> files;
+    if (!listBatch(path, files)) {
+        return 1;
+    }
+
+    std::mutex outputMutex;
+    std::atomic<uint64_t> statements{0};
+    std::atomic<size_t> failed{0};
+    auto start = std::chrono::steady_clock::now();
+    {
+        TaskGroup group(pool);
+        for (const std::string& file : files) {
+            group.run([&, file] {
+                static thread_local Arena arena;
+                arena.reset();
+
+                std::ostringstream result;
+                auto fileStart = std::chrono::steady_clock::now();
+                try {
+                    std::string content;
+                    if (!readFile(file, content)) {
+                        throw std::runtime_error("cannot read file");
+                    }
+                    Parser parser(std::make_unique<Lexer>(std::move(content)), false, &arena);
+                    AST* tree = parser.parse();
+                    if (check) {
+                        SymbolTableBuilder builder;
+                        tree->accept(builder);
+                        if (!builder.diagnostics().empty()) {
+                            const Diagnostic& diagnostic = builder.diagnostics().front();
+                            throw SourceError(diagnostic.offset, diagnostic.message);
+                        }
+                    }
+                    Interpreter interp;
+                    interp.setLimits(limits);
+                    interp.interpret(tree);
+                    statements.fetch_add(interp.statementsExecuted(), std::memory_order_relaxed);
+
+                    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - fileStart;
+                    result << file << "  " << elapsed.count() << " ms  "
+                           << interp.statementsExecuted() << " statements  ";
+                    interp.printGlobalScope(result);
+                } catch (const SourceError& e) {
+                    failed.fetch_add(1, std::memory_order_relaxed);
+                    result << file << "  error: " << SourceMap::fromFile(file).format(e.offset()) << ": "
+                           << e.what() << std::endl;
+                } catch (const std::exception& e) {
+                    failed.fetch_add(1, std::memory_order_relaxed);
+                    result << file << "  error: " << e.what() << std::endl;
+                }
+
+                std::lock_guard<std::mutex> lock(outputMutex);
+                std::cout << result.str() << std::flush;
+            });
+        }
+        group.wait();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    std::cout << files.size() << " files, " << failed.load() << " failed, " << statements.load()
+              << " statements in " << elapsed.count() << " s: " << files.size() / elapsed.count()
+              << " files/s, " << statements.load() / elapsed.count() << " statements/s" << std::endl;
+    return failed.load() == 0 ? 0 : 1;
+}
+
+/*
+* The value of a numeric option, the whole text a number of at most max.
+* Prints the error and returns false otherwise, a sign included.
+*/
+static bool optionValue(const std::string& option, const char* text, uint64_t max, uint64_t& value) {
+    const char* end = text + strlen(text);
+    std::from_chars_result result = std::from_chars(text, end, value);
+    if (result.ec != std::errc() || result.ptr != end || value > max) {
+        std::cerr << "Bad value for " << option << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cout << "please input your file" << std::endl;
+        std::cout << "usage: Part12 [--pipeline | --parallel-parse | --lazy] [--check | --parallel-check] [--parallel-exec] [--jobs n]" << std::endl;
+        std::cout << "              [--ssa | --passes name,...] [--dump-ir] [--cse] [--dse] [--outputs name,...]" << std::endl;
+        std::cout << "              [--max-steps n] [--timeout ms] [--max-depth n] [--osr-threshold n] [--profile-count out | --profile-sample out]" << std::endl;
+        std::cout << "              [--peephole-window n] [--peephole-stats]" << std::endl;
+        std::cout << "              [--sweep inputs.csv | --sweep-scalar inputs.csv] file|-" << std::endl;
+        std::cout << "       Part12 --batch [--check] [--jobs n] [--max-steps n] [--timeout ms] [--max-depth n] directory|manifest" << std::endl;
+        std::cout << "       Part12 --serve [--jobs n] [--max-steps n] [--timeout ms, default 10000] [--max-depth n] socket" << std::endl;
+        std::cout << "       Part12 --client socket file|- | --client socket --id id | --client socket --stop" << std::endl;
+        std::cout << "       Part12 --serialize file image" << std::endl;
+        std::cout << "       Part12 --load image" << std::endl;
+        std::cout << "       Part12 --compare-binary file" << std::endl;
+        return 1;
+    }
+    const std::string mode(argv[1]);
+    if (mode == "--serialize" && argc == 4) {
+        return serializeFile(argv[2], argv[3]);
+    }
+    if (mode == "--load" && argc == 3) {
+        return runImage(argv[2]);
+    }
+    if (mode == "--compare-binary" && argc == 3) {
+        return compareBinary(argv[2]);
+    }
+    if (mode == "--client" && argc == 5 && std::string(argv[3]) == "--id") {
+        return runClient(argv[2], std::string("CALL ") + argv[4] + "\n");
+    }
+    if (mode == "--client" && argc == 4 && std::string(argv[3]) == "--stop") {
+        return runClient(argv[2], "STOP\n");
+    }
+    if (mode == "--client" && argc == 4) {
+        std::string content;
+        if (!readFile(argv[3], content)) {
+            return 1;
+        }
+        return runClient(argv[2], "RUN\n" + content);
+    }
+
+    bool pipelined = false;
+    bool parallelParse = false;
+    bool lazy = false;
+    bool check = false;
+    bool parallelCheck = false;
+    std::vector<std::string> passes;
+    bool dumpIR = false;
+    bool cse = false;
+    bool dse = false;
+    std::vector<Atom> outputs;
+    bool parallelExec = false;
+    std::string sweepInputs;
+    bool scalarSweep = false;
+    bool batch = false;
+    bool serve = false;
+    ExecutionLimits limits;
+    bool timeoutGiven = false;
+    std::string profilePath;
+    Profiler::Mode profileMode = Profiler::Mode::Count;
+    size_t jobs = std::thread::hardware_concurrency();
+    uint32_t osrThreshold = Interpreter::OSR_THRESHOLD;
+    size_t peepholeWindow = SIZE_MAX;
+    bool peepholeStats = false;
+    int argi = 1;
+    for (; argi < argc - 1; argi++) {
+        const std::string option(argv[argi]);
+        if (option == "--pipeline") {
+            pipelined = true;
+        } else if (option == "--parallel-parse") {
+            parallelParse = true;
+        } else if (option == "--lazy") {
+            lazy = true;
+        } else if (option == "--check") {
+            check = true;
+        } else if (option == "--parallel-check") {
+            check = parallelCheck = true;
+        } else if (option == "--ssa") {
+            passes = {"copyprop", "constprop", "dce"};
+        } else if (option == "--passes" && argi + 2 < argc) {
+            // the ir passes to run, in order
+            std::istringstream names(argv[++argi]);
+            std::string name;
+            passes.clear();
+            while (std::getline(names, name, ',')) {
+                passes.push_back(name);
+            }
+        } else if (option == "--dump-ir") {
+            dumpIR = true;
+        } else if (option == "--cse") {
+            cse = true;
+        } else if (option == "--dse") {
+            dse = true;
+        } else if (option == "--outputs" && argi + 2 < argc) {
+            // only these variables are printed, everything else may be pruned
+            std::istringstream names(argv[++argi]);
+            std::string name;
+            while (std::getline(names, name, ',')) {
+                outputs.push_back(Interner::intern(name));
+            }
+            dse = true;
+        } else if ((option == "--sweep" || option == "--sweep-scalar") && argi + 2 < argc) {
+            sweepInputs = argv[++argi];
+            scalarSweep = option == "--sweep-scalar";
+        } else if (option == "--batch") {
+            batch = true;
+        } else if (option == "--serve") {
+            serve = true;
+        } else if (option == "--parallel-exec") {
+            parallelExec = true;
+        } else if ((option == "--profile-count" || option == "--profile-sample") && argi + 2 < argc) {
+            profilePath = argv[++argi];
+            profileMode = option == "--profile-count" ? Profiler::Mode::Count : Profiler::Mode::Sample;
+        } else if (option == "--max-steps" && argi + 2 < argc) {
+            if (!optionValue(option, argv[++argi], UINT64_MAX, limits.maxSteps)) {
+                return 1;
+            }
+        } else if (option == "--timeout" && argi + 2 < argc) {
+            uint64_t timeout;
+            if (!optionValue(option, argv[++argi], INT64_MAX, timeout)) {
+                return 1;
+            }
+            limits.timeout = std::chrono::milliseconds(timeout);
+            timeoutGiven = true;
+        } else if (option == "--max-depth" && argi + 2 < argc) {
+            uint64_t depth;
+            if (!optionValue(option, argv[++argi], StatementDepth::MAX_NATIVE_DEPTH, depth)) {
+                return 1;
+            }
+            limits.maxDepth = static_cast<unsigned>(depth);
+        } else if (option == "--jobs" && argi + 2 < argc) {
+            uint64_t workers;
+            if (!optionValue(option, argv[++argi], ThreadPool::MAX_THREADS, workers)) {
+                return 1;
+            }
+            jobs = workers;
+        } else if (option == "--osr-threshold" && argi + 2 < argc) {
+            // back edges before a loop is compiled, 0 never compiles
+            uint64_t threshold;
+            if (!optionValue(option, argv[++argi], UINT32_MAX, threshold)) {
+                return 1;
+            }
+            osrThreshold = threshold;
+            if (osrThreshold == 0) {
+                osrThreshold = Interpreter::NO_OSR;
+            }
+        } else if (option == "--peephole-window" && argi + 2 < argc) {
+            // widest peephole rule used, 0 turns the optimizer off
+            uint64_t window;
+            if (!optionValue(option, argv[++argi], SIZE_MAX, window)) {
+                return 1;
+            }
+            peepholeWindow = window;
+        } else if (option == "--peephole-stats") {
+            peepholeStats = true;
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return 1;
+        }
+    }
+
+    // "-" reads the program from stdin
+    const std::string filepath(argv[argi]);
+
+    std::unique_ptr<ThreadPool> pool;
+    if (parallelParse || parallelCheck || parallelExec || batch || serve) {
+        pool = std::make_unique<ThreadPool>(jobs);
+    }
+
+    if (batch) {
+        return runBatch(filepath, *pool, check, limits);
+    }
+    if (serve) {
+        if (!timeoutGiven) {
+            limits.timeout = Server::DEFAULT_TIMEOUT;
+        }
+        return runServer(filepath, *pool, limits);
+    }
+
+    // streamed stdin is gone once lexed, messages then give plain offsets
+    SourceMap source = filepath == "-" ? SourceMap("<stdin>") : SourceMap::fromFile(filepath);
+
+    std::unique_ptr<ParallelParser> parallelParser;
+    std::unique_ptr<LazyParser> lazyParser;
+    AST* tree = nullptr;
+    try {
+        if (lazy) {
+            std::string content;
+            if (!readFile(filepath, content)) {
+                return 1;
+            }
+            lazyParser = std::make_unique<LazyParser>(std::move(content));
+            tree = lazyParser->parse();
+        } else if (parallelParse) {
+            // needs the whole text in memory to hand out procedure ranges
+            std::string content;
+            if (!readFile(filepath, content)) {
+                return 1;
+            }
+            parallelParser = std::make_unique<ParallelParser>(std::move(content), *pool);
+            tree = parallelParser->parse();
+        } else {
+            int fd = filepath == "-" ? STDIN_FILENO : open(filepath.c_str(), O_RDONLY);
+
+            if (fd < 0) {
+                std::cerr << "Failed to open file: " << filepath << std::endl;
+                return 1;
+            }
+
+            std::unique_ptr<Lexer> lexer = std::make_unique<Lexer>(fd);
+            Parser parser(std::move(lexer), pipelined);
+            tree = parser.parse();
+
+            if (fd != STDIN_FILENO) {
+                close(fd);
+            }
+        }
+    } catch (const SourceError& e) {
+        std::cerr << source.format(e.offset()) << ": " << e.what() << std::endl;
+        return 1;
+    }
+
+    // with --lazy, bodies are checked on their first call and the builder keeps their scopes
+    std::unique_ptr<SymbolTableBuilder> builder;
+    if (check) {
+        builder = std::make_unique<SymbolTableBuilder>(parallelCheck ? pool.get() : nullptr, lazy);
+        tree->accept(*builder);
+        for (const Diagnostic& diagnostic : builder->diagnostics()) {
+            std::cerr << source.format(diagnostic.offset) << ": " << diagnostic.message << std::endl;
+        }
+        if (!builder->diagnostics().empty()) {
+            return 1;
+        }
+    }
+
+    // owns the statements it puts into the tree
+    IRLowering lowering;
+    if (!passes.empty()) {
+        try {
+            PassManager manager(dumpIR ? &std::cerr : nullptr);
+            for (const std::string& name : passes) {
+                manager.add(PassManager::create(name));
+            }
+            auto start = std::chrono::steady_clock::now();
+            std::vector<IRFunction> functions = IRBuilder().build(*static_cast<Program*>(tree));
+            auto buildTime = std::chrono::steady_clock::now() - start;
+            size_t before = 0;
+            for (const IRFunction& fn : functions) {
+                before += fn.size();
+            }
+            manager.run(functions);
+            size_t after = 0;
+            for (const IRFunction& fn : functions) {
+                after += fn.size();
+            }
+            start = std::chrono::steady_clock::now();
+            lowering.lower(functions);
+            auto lowerTime = std::chrono::steady_clock::now() - start;
+
+            using us = std::chrono::microseconds;
+            std::cerr << "ssa: build " << std::chrono::duration_cast<us>(buildTime).count() << " us, "
+                      << before << " instructions" << std::endl;
+            for (const PassManager::Timing& timing : manager.timings()) {
+                std::cerr << "ssa: " << timing.pass << " " << std::chrono::duration_cast<us>(timing.time).count()
+                          << " us, " << timing.changed << " changed" << std::endl;
+            }
+            std::cerr << "ssa: lower " << std::chrono::duration_cast<us>(lowerTime).count() << " us, "
+                      << after << " instructions, " << lowering.temporaries() << " temporaries" << std::endl;
+        } catch (const SourceError& e) {
+            // a lazily parsed procedure body
+            std::cerr << source.format(e.offset()) << ": " << e.what() << std::endl;
+            return 1;
+        } catch (const std::runtime_error& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    // owns the nodes it adds to the tree
+    CommonSubexpressions subexpressions;
+    if (cse) {
+        try {
+            subexpressions.run(*static_cast<Program*>(tree));
+        } catch (const SourceError& e) {
+            // a lazily parsed procedure body
+            std::cerr << source.format(e.offset()) << ": " << e.what() << std::endl;
+            return 1;
+        }
+        std::cerr << "cse: " << subexpressions.eliminated() << " nodes eliminated, "
+                  << subexpressions.temporaries() << " temporaries" << std::endl;
+    }
+    if (dse) {
+        DeadStores deadStores(outputs);
+        try {
+            deadStores.run(*static_cast<Program*>(tree));
+        } catch (const SourceError& e) {
+            std::cerr << source.format(e.offset()) << ": " << e.what() << std::endl;
+            return 1;
+        }
+        std::cerr << "dse: " << deadStores.removedStores() << " stores and "
+                  << deadStores.removedDeclarations() << " declarations removed" << std::endl;
+    }
+
+    if (!sweepInputs.empty()) {
+        try {
+            return runSweep(tree, sweepInputs, scalarSweep, outputs);
+        } catch (const SourceError& e) {
+            std::cerr << source.format(e.offset()) << ": " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    PeepholeOptimizer peephole(PeepholeOptimizer::standardRules(), peepholeWindow);
+    std::unique_ptr<Profiler> profiler;
+    std::unique_ptr<Interpreter> interp;
+    if (!profilePath.empty()) {
+        profiler = std::make_unique<Profiler>(profileMode);
+        interp = std::make_unique<ProfilingInterpreter>(*profiler);
+    } else {
+        interp = std::make_unique<Interpreter>(parallelExec ? pool.get() : nullptr);
+        interp->setOsrThreshold(osrThreshold);
+        interp->setPeephole(&peephole);
+    }
+    interp->setLimits(limits);
+    try {
+        interp->interpret(tree);
+    } catch (const ExecutionAborted& e) {
+        std::cerr << source.format(e.offset()) << ": " << e.what() << std::endl;
+        return 2;
+    } catch (const SourceError& e) {
+        // a lazily parsed procedure body
+        std::cerr << source.format(e.offset()) << ": " << e.what() << std::endl;
+        return 1;
+    }
+    interp->printGlobalScope(std::cout, outputs);
+    if (peepholeStats) {
+        PeepholeOptimizer::Statistics stats = peephole.statistics();
+        std::cerr << "peephole: " << stats.before - stats.after << " of " << stats.before << " instructions removed";
+        for (size_t r = 0; r < stats.applied.size(); r++) {
+            std::cerr << (r == 0 ? " (" : ", ") << peephole.rules()[r].name << " " << stats.applied[r];
+        }
+        std::cerr << (stats.applied.empty() ? "" : ")") << std::endl;
+    }
+
+    if (profiler != nullptr) {
+        std::ofstream out(profilePath);
+        profiler->writeFolded(out, source);
+        if (!out) {
+            std::cerr << "Failed to write profile: " << profilePath << std::endl;
+            return 1;
+        }
+        if (profiler->droppedSamples() > 0) {
+            std::cerr << profiler->droppedSamples() << " samples dropped, the sample buffer is full" << std::endl;
+        }
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -44,9 +44,20 @@
  *                  | statement SEMI statement_list
  *
  *   statement : compound_statement
+ *             | proccall_statement
  *             | assignment_statement
+ *             | while_statement
+ *             | for_statement
  *             | empty
  *
+ *   proccall_statement : ID LPAREN RPAREN
+ *
+ *   while_statement : WHILE condition DO statement
+ *
+ *   for_statement : FOR variable ASSIGN expr TO expr DO statement
+ *
+ *   condition : expr (EQUAL | NOT_EQUAL | LESS | LESS_EQUAL | GREATER | GREATER_EQUAL) expr
+ *
  *   assignment_statement : variable ASSIGN expr
  *
  *   empty :
@@ -66,10 +77,28 @@
  */
 #include <memory>
 #include <cassert>
+#include <cstdint>
 #include <string>
+#include <iostream>
+#include <string_view>
+#include <deque>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
 #include <list>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <functional>
+#include <condition_variable>
+#include <new>
+#include <type_traits>
+#include <chrono>
+#include <stdexcept>
 
 /*
 * Token types
@@ -100,6 +129,16 @@ enum class TokenType {
     Real,
     Comma,
     Colon,
+    While,
+    Do,
+    Equal,
+    NotEqual,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    For,
+    To,
     TYPE_EOF,
 };
 
@@ -113,6 +152,11 @@ class NoOp;
 class Block;
 class VarDecl;
 class ProcedureDecl;
+class ProcedureCall;
+class While;
+class For;
+struct Bytecode;
+class PeepholeOptimizer;
 class Var;
 class Type;
 class Program;
@@ -120,19 +164,300 @@ class SymbolTable;
 class BuiltinTypeSymbol;
 class Symbol;
 
+/*
+* Identifiers are interned once, in the lexer, into a 32-bit atom.
+* Every later stage compares and hashes atoms instead of strings.
+*/
+using Atom = uint32_t;
+constexpr Atom NO_ATOM = UINT32_MAX;
+
+class Interner {
+ public:
+    /*
+    * Safe to call from several lexers at once.
+    */
+    static Atom intern(std::string_view text);
+    /*
+    * Lock-free, any atom handed out by intern() can be resolved.
+    */
+    static const std::string& name(Atom atom);
+
+ private:
+    static Interner& global();
+    static uint32_t hash(std::string_view text);
+    std::string& slotFor(Atom atom);
+
+    static constexpr size_t CHUNK_BITS = 12;
+    static constexpr size_t MAX_CHUNKS = 4096;
+    static constexpr size_t SHARD_COUNT = 64;   // power of two
+
+    struct Slot {
+        uint32_t hash;
+        Atom atom = NO_ATOM;
+    };
+
+    /*
+    * Lexers on different threads mostly hit different shards.
+    */
+    struct Shard {
+        void grow();
+
+        std::mutex mutex;   // guards slots and size
+        // open addressing on the text hash, the text itself is only compared on a hash match
+        std::vector<Slot> slots;
+        size_t size = 0;
+    };
+
+    Shard shards_[SHARD_COUNT];
+    // names are stored in fixed chunks that never move
+    std::atomic<std::string*> chunks_[MAX_CHUNKS] = {};
+    std::atomic<Atom> nextAtom_{0};
+};
+
+/*
+* Flat open-addressing hash map keyed by atoms (Robin Hood probing).
+* Entries live in one array, a lookup is a multiply, a shift and a short
+* linear probe. Iteration order is the slot order, callers that print
+* the contents sort by name themselves. Other integer ids can be keys as
+* well, all bits set is reserved for empty slots.
+*/
+template <typename V, typename K = Atom>
+class AtomMap {
+ public:
+    V* find(K key) {
+        if (slots_.empty()) {
+            return nullptr;
+        }
+        size_t pos = home(key);
+        for (uint32_t dist = 0; ; dist++, pos = (pos + 1) & mask_) {
+            Slot& slot = slots_[pos];
+            if (slot.key == key) {
+                return &slot.value;
+            }
+            // an entry this close to home means key would have displaced it
+            if (slot.key == EMPTY || slot.dist < dist) {
+                return nullptr;
+            }
+        }
+    }
+
+    V& operator[](K key) {
+        V* value = find(key);
+        if (value != nullptr) {
+            return *value;
+        }
+        if ((size_ + 1) * 5 > slots_.size() * 4) {
+            grow();
+        }
+        return insert(key, V());
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    template <typename F>
+    void forEach(F fn) const {
+        for (const Slot& slot : slots_) {
+            if (slot.key != EMPTY) {
+                fn(slot.key, slot.value);
+            }
+        }
+    }
+
+ private:
+    static constexpr K EMPTY = ~K(0);
+
+    struct Slot {
+        K key = EMPTY;
+        uint32_t dist = 0;  // distance from the home slot
+        V value = V();
+    };
+
+    size_t home(K key) const {
+        return (static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull) >> shift_;
+    }
+
+    /*
+    * key must not be present and there must be a free slot.
+    */
+    V& insert(K key, V&& value) {
+        Slot entry{key, 0, std::move(value)};
+        V* result = nullptr;
+        size_t pos = home(key);
+        for (; ; entry.dist++, pos = (pos + 1) & mask_) {
+            Slot& slot = slots_[pos];
+            if (slot.key == EMPTY) {
+                slot = std::move(entry);
+                size_++;
+                return result != nullptr ? *result : slot.value;
+            }
+            // take from the rich: the entry closer to its home moves on
+            if (slot.dist < entry.dist) {
+                std::swap(slot, entry);
+                if (result == nullptr) {
+                    result = &slot.value;
+                }
+            }
+        }
+    }
+
+    void grow() {
+        std::vector<Slot> old;
+        old.swap(slots_);
+        size_t capacity = old.empty() ? 16 : old.size() * 2;
+        slots_.resize(capacity);
+        mask_ = capacity - 1;
+        shift_ = 64;
+        while (capacity > 1) {
+            capacity >>= 1;
+            shift_--;
+        }
+        size_ = 0;
+        for (Slot& slot : old) {
+            if (slot.key != EMPTY) {
+                insert(slot.key, std::move(slot.value));
+            }
+        }
+    }
+
+    std::vector<Slot> slots_;
+    size_t mask_ = 0;
+    uint32_t shift_ = 64;
+    size_t size_ = 0;
+};
+
 class Token {
  public:
-    Token(TokenType type, std::string value) : type_(type), value_(value) {}
+    Token(TokenType type, std::string value, Atom atom = NO_ATOM) :
+        type_(type), value_(value), atom_(atom) {}
+    /*
+    * ID token, the text only lives in the interner
+    */
+    Token(TokenType type, Atom atom) : type_(type), atom_(atom) {}
+    Token() : type_(TokenType::TYPE_EOF), atom_(NO_ATOM) {}
 
     friend std::ostream& operator<<(std::ostream& os, const Token& tk);
 
     TokenType type_;
     std::string value_;
+    Atom atom_;
+    uint32_t offset_ = 0;    // of the first char in the source
+};
+
+/*
+* An error at a place in the program text, SourceMap turns the byte
+* offset into a line and column when the message is printed.
+*/
+class SourceError : public std::runtime_error {
+ public:
+    SourceError(uint32_t offset, const std::string& message) : std::runtime_error(message), offset_(offset) {}
+
+    uint32_t offset() const {
+        return offset_;
+    }
+
+ private:
+    uint32_t offset_;
+};
+
+struct SourceLocation {
+    uint32_t line;      // from 1, 0 when unknown
+    uint32_t column;
+};
+
+/*
+* Maps byte offsets of a program text to lines and columns. Nothing is
+* counted while lexing: the index of line starts is built on the first
+* lookup, which only happens when a diagnostic or a profile is printed.
+*/
+class SourceMap {
+ public:
+    /*
+    * name is used in messages, the text is not available.
+    */
+    explicit SourceMap(std::string name) : name_(std::move(name)) {}
+    SourceMap(std::string name, std::string text) : name_(std::move(name)), text_(std::move(text)), hasText_(true) {}
+
+    /*
+    * The file is only read on the first lookup, streamed input keeps
+    * costing nothing until something has to be reported.
+    */
+    static SourceMap fromFile(const std::string& path) {
+        SourceMap map(path);
+        map.readFile_ = true;
+        return map;
+    }
+
+    SourceLocation locate(uint32_t offset) const;
+    /*
+    * "name:line:column", or "name, offset n" without the text.
+    */
+    std::string format(uint32_t offset) const;
+
+ private:
+    void index() const;
+
+    std::string name_;
+    mutable std::string text_;
+    mutable bool hasText_ = false;
+    mutable bool readFile_ = false;
+    mutable bool indexed_ = false;
+    mutable std::vector<uint32_t> lineStarts_;
+};
+
+class Lexer;
+
+/*
+* Fixed-size ring of pre-lexed tokens. The lexer fills the free slots in
+* one batch, the parser consumes from the front and can look ahead
+* without lexing again. Slots are reused, nothing is copied on pop.
+*/
+class TokenRing {
+ public:
+    static constexpr size_t CAPACITY = 256;   // power of two
+
+    bool full() const {
+        return count_ == CAPACITY;
+    }
+    size_t size() const {
+        return count_;
+    }
+    Token& at(size_t k) {
+        return tokens_[(head_ + k) & (CAPACITY - 1)];
+    }
+    void push(Token&& tk) {
+        tokens_[(head_ + count_) & (CAPACITY - 1)] = std::move(tk);
+        count_++;
+    }
+    void pop() {
+        head_ = (head_ + 1) & (CAPACITY - 1);
+        count_--;
+    }
+
+ private:
+    Token tokens_[CAPACITY];
+    size_t head_ = 0;
+    size_t count_ = 0;
 };
 
 class Lexer {
  public:
     explicit Lexer(std::string&& text);
+    /*
+    * Read the program from fd through a fixed-size buffer that is
+    * refilled as the lexer moves on, memory does not grow with the input.
+    * The descriptor is not closed by the lexer.
+    */
+    explicit Lexer(int fd);
+    /*
+    * Lex size bytes at text in place, the caller keeps them alive.
+    */
+    Lexer(const char* text, size_t size);
+    Lexer(const Lexer&) = delete;
+    Lexer& operator=(const Lexer&) = delete;
+    ~Lexer();
+
     void advance();
     char* peek();
     void skipWhiteSpace();
@@ -152,12 +477,200 @@ class Lexer {
     * */
     Token getNextToken();
 
- private:   
+    /*
+    * Lex tokens into the free slots of ring, stops early after EOF.
+    */
+    void fill(TokenRing& ring);
+
+    /*
+    * Source offset of the first char, for text cut out of a larger source.
+    */
+    void setOffset(uint32_t offset) {
+        base_ = offset;
+    }
+
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+ private:
+    void initKeywords();
+
+    /*
+    * Load the next chunk of a streamed input behind the bytes that are still
+    * needed: the token being scanned (from tokenStart_) or the current char.
+    * Returns false at the end of the input or for in-memory text.
+    */
+    bool refill();
+
+    Token scanToken();
+    uint32_t offsetOf(const char* p) const;
+
     char* textStart_ = nullptr;
     char* textEnd_ = nullptr;
     char* currentPtr_ = nullptr; 
+    char* tokenStart_ = nullptr;   // first char of the identifier or number being scanned
+    int fd_ = -1;
+    bool ownsText_ = true;
+    uint64_t base_ = 0;            // source offset of textStart_, grows as a stream is refilled
+    uint32_t tokenOffset_ = 0;
+
+    std::unordered_map<Atom, Token> RESERVED_KEYWORDS;
+};
+
+/*
+* Runs a lexer on its own thread. Tokens reach the consumer in batches
+* through a lock-free single-producer single-consumer queue, so scanning
+* bytes overlaps with building the tree. Errors of the lexer are rethrown
+* to the consumer once it has taken all tokens lexed before them.
+*/
+class TokenPipeline {
+ public:
+    explicit TokenPipeline(std::unique_ptr<Lexer>&& lexer);
+    ~TokenPipeline();
+
+    /*
+    * Same contract as Lexer::fill, called from the consumer thread only.
+    */
+    void fill(TokenRing& ring);
+
+    static constexpr size_t BATCH_SIZE = 512;
+    static constexpr size_t QUEUE_DEPTH = 8;
+
+ private:
+    struct Batch {
+        Token tokens[BATCH_SIZE];
+        size_t count = 0;
+    };
+
+    void produce();
+
+    std::unique_ptr<Lexer> lexer_;
+    std::unique_ptr<Batch[]> batches_;
+    // batches in [head_, tail_) are ready, both only grow
+    std::atomic<size_t> head_{0};
+    std::atomic<size_t> tail_{0};
+    std::atomic<bool> finished_{false};   // producer will publish no more batches
+    std::atomic<bool> stop_{false};
+    std::exception_ptr error_;
+    size_t readPos_ = 0;    // next token in the front batch
+    bool eof_ = false;
+    std::thread thread_;
+};
+
+/*
+* Bump allocator for AST nodes. Objects made in an arena are destroyed
+* together with it, in reverse order, there is no per-node delete.
+*/
+class Arena {
+ public:
+    /*
+    * Allocations beyond limit bytes throw, so a single request
+    * cannot take all memory.
+    */
+    explicit Arena(size_t limit = SIZE_MAX) : limit_(limit) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+    ~Arena();
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        void* mem = allocate(sizeof(T), alignof(T));
+        T* obj = new (mem) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            destructors_.emplace_back(obj, [](void* p) { static_cast<T*>(p)->~T(); });
+        }
+        return obj;
+    }
+
+    size_t bytesUsed() const {
+        return used_;
+    }
+
+    /*
+    * Destroy everything allocated so far and start over in the first
+    * block, so one arena can serve a long run of short lived trees.
+    */
+    void reset();
+
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+ private:
+    void* allocate(size_t size, size_t align);
+
+    std::vector<char*> blocks_;
+    char* cur_ = nullptr;
+    char* end_ = nullptr;
+    size_t used_ = 0;
+    size_t limit_;
+    std::vector<std::pair<void*, void (*)(void*)>> destructors_;
+};
+
+/*
+* Fixed set of worker threads with one task deque each. A worker runs its
+* own tasks newest first and steals the oldest task of another worker
+* when it runs dry. Tasks submitted from a worker stay on its deque.
+*/
+class ThreadPool {
+ public:
+    explicit ThreadPool(size_t threads = std::thread::hardware_concurrency());
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+
+    /*
+    * Run one queued task on the calling thread, false if there was none.
+    * Lets a thread that waits for tasks help instead of blocking.
+    */
+    bool runOne();
+
+    size_t size() const {
+        return workers_.size();
+    }
 
-    std::unordered_map<std::string, Token> RESERVED_KEYWORDS;
+    // more threads than this is a typo, not a machine
+    static constexpr size_t MAX_THREADS = 1024;
+
+ private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+        std::thread thread;
+    };
+
+    void workerLoop(size_t index);
+    bool take(size_t self, std::function<void()>& task);
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::mutex sleepMutex_;
+    std::condition_variable wakeup_;
+    std::atomic<size_t> queued_{0};
+    std::atomic<size_t> nextWorker_{0};
+    bool stop_ = false;
+};
+
+/*
+* Tasks that are waited for together. wait() helps the pool
+* instead of blocking and rethrows the first exception of a task.
+* The destructor only waits: an error nobody called wait() for, e.g.
+* while unwinding from another exception, is dropped.
+*/
+class TaskGroup {
+ public:
+    explicit TaskGroup(ThreadPool& pool) : pool_(pool) {}
+    ~TaskGroup() {
+        drain();
+    }
+
+    void run(std::function<void()> task);
+    void wait();
+
+ private:
+    // run or wait for the pending tasks, never throws
+    void drain() noexcept;
+
+    ThreadPool& pool_;
+    std::atomic<size_t> pending_{0};
+    std::mutex errorMutex_;
+    std::exception_ptr error_;
 };
 
 /*********************************************************************************************************************
@@ -181,26 +694,68 @@ class NodeVisitor {
     virtual void visit(VarDecl& vDecl) { assert(0); }
     virtual void visit(Type& tp) { assert(0); }
     virtual void visit(ProcedureDecl& pd) {}
+    virtual void visit(ProcedureCall& pc) { assert(0); }
+    virtual void visit(While& loop) { assert(0); }
+    virtual void visit(For& loop) { assert(0); }
 };
 
+/*
+* One scope. Lookups continue in the enclosing scopes, the outermost
+* scope holds the builtin types.
+*/
 class SymbolTable {
  public:
-    SymbolTable() {
-        initBuiltins();
+    SymbolTable(Atom scopeName = NO_ATOM, int scopeLevel = 1, SymbolTable* enclosing = nullptr) :
+            scopeName_(scopeName), scopeLevel_(scopeLevel), enclosing_(enclosing) {
+        if (enclosing_ == nullptr) {
+            initBuiltins();
+        }
     }
     std::string getPrettyPrintedString();
     void define(Symbol* symbol);
-    Symbol* lookup(std::string& name);
+    /*
+    * Only reads, safe while other threads look up the same scope.
+    */
+    Symbol* lookup(Atom name, bool currentScopeOnly = false);
+
+    int scopeLevel() const {
+        return scopeLevel_;
+    }
 
  private:
     void initBuiltins();
 
-    std::map<std::string, Symbol*> symbols_;
+    AtomMap<Symbol*> symbols_;
+    Atom scopeName_;
+    int scopeLevel_;
+    SymbolTable* enclosing_;
+};
+
+/*
+* A problem found in a program, at a byte offset of its text.
+*/
+struct Diagnostic {
+    uint32_t offset;
+    std::string message;
 };
 
+/*
+* Semantic analysis. The bodies of a block's procedures are checked once all
+* declarations of the block are known, each in its own scope. Given a pool,
+* sibling bodies are checked concurrently: their enclosing scopes are no
+* longer written then, so they are read without locks. Diagnostics are
+* collected per body and merged in source order, so the result does not
+* depend on scheduling.
+*/
 class SymbolTableBuilder {
  public:
-    SymbolTableBuilder() : symtab() {}
+    /*
+    * With deferLazyBodies, the bodies of procedures that are not parsed yet
+    * (LazyParser) are checked when they are first called. The builder must
+    * then live as long as the program runs.
+    */
+    explicit SymbolTableBuilder(ThreadPool* pool = nullptr, bool deferLazyBodies = false) :
+            pool_(pool), deferLazyBodies_(deferLazyBodies) {}
 
     void visit(BinOp& bo);
     void visit(UnaryOp& uo);
@@ -214,21 +769,49 @@ class SymbolTableBuilder {
     void visit(Block& blk);
     void visit(VarDecl& vDecl);
     void visit(Type& tp);
-    void visit(ProcedureDecl& pd) {}
+    void visit(ProcedureDecl& pd);
+    void visit(ProcedureCall& pc);
+    void visit(While& loop);
+    /*
+    * The body may neither assign the variable nor use it for a nested FOR.
+    */
+    void visit(For& loop);
+
+    const std::vector<Diagnostic>& diagnostics() const {
+        return diagnostics_;
+    }
 
  private:
-    SymbolTable symtab;
+    SymbolTableBuilder(ThreadPool* pool, bool deferLazyBodies, std::unique_ptr<SymbolTable>&& scope) :
+            pool_(pool), deferLazyBodies_(deferLazyBodies), scope_(std::move(scope)), symtab(scope_.get()) {}
+
+    void analyzeProcedures(const std::vector<ProcedureDecl*>& procedures);
+    void error(uint32_t offset, const std::string& message) {
+        diagnostics_.push_back({offset, message});
+    }
+
+    ThreadPool* pool_;
+    bool deferLazyBodies_;
+    std::unique_ptr<SymbolTable> scope_;
+    SymbolTable* symtab = nullptr;    // current scope
+    std::vector<ProcedureDecl*> pendingProcedures_;
+    std::vector<std::unique_ptr<SymbolTableBuilder>> bodies_;
+    std::vector<Diagnostic> diagnostics_;
+    std::vector<Atom> controls_;    // variables of the FOR loops around
 };
 
 class AST {
  public:
     virtual int accept(NodeVisitor& visitor) = 0;
     virtual void accept(SymbolTableBuilder& visitor) = 0;
+
+    // first char of the node in the source
+    uint32_t offset_ = 0;
 };
 
 class Program : public AST {
  public:
-    Program(std::string& name, Block* blk) : name_(name), block_(blk) {}
+    Program(Atom name, Block* blk) : name_(name), block_(blk) {}
 
     int accept(NodeVisitor& visitor) override {
         visitor.visit(*this);
@@ -239,7 +822,7 @@ class Program : public AST {
         visitor.visit(*this);
     }
 
-    std::string name_;
+    Atom name_;
     Block* block_;
 };
 
@@ -282,7 +865,9 @@ class VarDecl : public AST {
 
 class Type : public AST {
  public:
-    Type(Token& tk) : token_(tk), value_(tk.value_) {}
+    Type(Token& tk) : token_(tk), value_(tk.atom_) {
+        offset_ = tk.offset_;
+    }
 
     int accept(NodeVisitor& visitor) override {
         visitor.visit(*this);
@@ -294,7 +879,7 @@ class Type : public AST {
     }
 
     Token token_;
-    std::string value_;
+    Atom value_;
 };
 
 class Compound : public AST {
@@ -330,7 +915,9 @@ class Assign : public AST {
 */
 class Var : public AST {
  public:
-    Var(Token& tk) : token_(tk), value_(tk.value_) {}
+    Var(Token& tk) : token_(tk), value_(tk.atom_) {
+        offset_ = tk.offset_;
+    }
     int accept(NodeVisitor& visitor) override {
         return visitor.visit(*this);
     }
@@ -338,12 +925,28 @@ class Var : public AST {
         visitor.visit(*this);
     }
     Token token_;
-    std::string value_;
+    Atom value_;
+};
+
+/*
+* The unparsed block of a procedure, see LazyParser.
+*/
+struct LazyBlock {
+    LazyBlock(const char* text, size_t size, uint32_t offset) : text(text), size(size), offset(offset) {}
+
+    const char* text;
+    size_t size;
+    uint32_t offset;                        // of text in the source
+    SymbolTableBuilder* checker = nullptr;  // checks the block once it is parsed
+    Arena arena;
+    std::once_flag once;
+    std::atomic<bool> parsed{false};
 };
 
 class ProcedureDecl : public AST {
  public:
-    ProcedureDecl(std::string& name, Block* blk) : name_(name), blk_(blk) {}
+    ProcedureDecl(Atom name, Block* blk) : name_(name), blk_(blk) {}
+    ProcedureDecl(Atom name, LazyBlock* lazy) : name_(name), blk_(nullptr), lazy_(lazy) {}
     int accept(NodeVisitor& visitor) override {
         visitor.visit(*this);
         return -1;
@@ -351,12 +954,37 @@ class ProcedureDecl : public AST {
     void accept(SymbolTableBuilder& visitor) override {
         visitor.visit(*this);
     }
-    std::string name_;
+    /*
+    * The block, parsed on the first call if it is lazy. Thread safe.
+    * Throws SourceError for a syntax error or a failed deferred check.
+    */
+    Block* body() {
+        return lazy_ == nullptr ? blk_ : parseLazily();
+    }
+    bool isParsed() const {
+        return lazy_ == nullptr || lazy_->parsed.load(std::memory_order_acquire);
+    }
+    /*
+    * Check the block with checker once it is parsed, instead of now.
+    */
+    void deferCheck(SymbolTableBuilder* checker) {
+        lazy_->checker = checker;
+    }
+
+    Atom name_;
+
+ private:
+    Block* parseLazily();
+
     Block* blk_;
+    LazyBlock* lazy_ = nullptr;
 };
 
-class NoOp : public AST {
+class ProcedureCall : public AST {
  public:
+    ProcedureCall(Token& tk) : token_(tk), procName_(tk.atom_) {
+        offset_ = tk.offset_;
+    }
     int accept(NodeVisitor& visitor) override {
         visitor.visit(*this);
         return -1;
@@ -364,56 +992,226 @@ class NoOp : public AST {
     void accept(SymbolTableBuilder& visitor) override {
         visitor.visit(*this);
     }
+    Token token_;
+    Atom procName_;
 };
 
-class BinOp : public AST {
+/*
+* A WHILE or FOR. The interpreter counts the back edges it takes, across
+* runs of the tree, and once a loop is hot it compiles the loop to
+* Bytecode and runs the remaining iterations there.
+*/
+class Loop : public AST {
  public:
-    BinOp(AST* left, Token op, AST* right) : left_(left), op_(op), right_(right) {}
+    explicit Loop(AST* body) : body_(body) {}
+    ~Loop();
 
-    int accept(NodeVisitor& visitor) override {
-        return visitor.visit(*this);
-    }
-    void accept(SymbolTableBuilder& visitor) override {
-        visitor.visit(*this);
-    } 
-    Token op_;
-    AST* left_ = nullptr;
-    AST* right_ = nullptr;
+    /*
+    * Compiled and optimized by the first caller, later ones share the
+    * code. Without a peephole optimizer PeepholeOptimizer::standard() is
+    * used.
+    */
+    const Bytecode& compiled(PeepholeOptimizer* peephole = nullptr);
+
+    AST* body_;
+    std::atomic<uint32_t> backEdges_{0};
+
+ private:
+    std::once_flag compileOnce_;
+    std::unique_ptr<Bytecode> compiled_;
 };
 
-class UnaryOp : public AST {
+class While : public Loop {
  public:
-    UnaryOp(Token& op, AST* expr) : op_(op), expr_(expr) {}
+    While(AST* condition, AST* body) : Loop(body), condition_(condition) {}
+
     int accept(NodeVisitor& visitor) override {
-        return visitor.visit(*this);
+        visitor.visit(*this);
+        return -1;
     }
     void accept(SymbolTableBuilder& visitor) override {
         visitor.visit(*this);
-    }    
-    Token op_;
-    AST* expr_;
+    }
+
+    AST* condition_;    // a BinOp with a comparison
 };
 
-class Num : public AST {
+/*
+* FOR variable := from TO to DO body. Both bounds are evaluated once,
+* before the first iteration, and the body does not run when from > to.
+* The loop counts on its own and stores the count to the variable before
+* each iteration, the body may not assign it. After the loop the variable
+* holds to, or is unchanged when the body never ran.
+*/
+class For : public Loop {
  public:
-    Num(Token& token) : token_(token), value_(token.value_) {}
+    For(Var* variable, AST* from, AST* to, AST* body) : Loop(body), variable_(variable), from_(from), to_(to) {}
+
     int accept(NodeVisitor& visitor) override {
-        return visitor.visit(*this);
+        visitor.visit(*this);
+        return -1;
     }
     void accept(SymbolTableBuilder& visitor) override {
         visitor.visit(*this);
-    }    
+    }
 
-    Token token_;
+    Var* variable_;
+    AST* from_;
+    AST* to_;
+};
+
+class NoOp : public AST {
+ public:
+    int accept(NodeVisitor& visitor) override {
+        visitor.visit(*this);
+        return -1;
+    }
+    void accept(SymbolTableBuilder& visitor) override {
+        visitor.visit(*this);
+    }
+};
+
+class BinOp : public AST {
+ public:
+    BinOp(AST* left, Token op, AST* right) : left_(left), op_(std::move(op)), right_(right) {
+        offset_ = op_.offset_;
+    }
+
+    int accept(NodeVisitor& visitor) override {
+        return visitor.visit(*this);
+    }
+    void accept(SymbolTableBuilder& visitor) override {
+        visitor.visit(*this);
+    } 
+    Token op_;
+    AST* left_ = nullptr;
+    AST* right_ = nullptr;
+};
+
+class UnaryOp : public AST {
+ public:
+    UnaryOp(Token& op, AST* expr) : op_(op), expr_(expr) {
+        offset_ = op.offset_;
+    }
+    int accept(NodeVisitor& visitor) override {
+        return visitor.visit(*this);
+    }
+    void accept(SymbolTableBuilder& visitor) override {
+        visitor.visit(*this);
+    }    
+    Token op_;
+    AST* expr_;
+};
+
+class Num : public AST {
+ public:
+    Num(Token& token) : token_(token), value_(token.value_) {
+        offset_ = token.offset_;
+    }
+    int accept(NodeVisitor& visitor) override {
+        return visitor.visit(*this);
+    }
+    void accept(SymbolTableBuilder& visitor) override {
+        visitor.visit(*this);
+    }    
+
+    Token token_;
     std::string value_;
 };
 
+/*
+* Counts the BinOp/UnaryOp levels a visitor has recursed into on this
+* thread. Past MAX_NATIVE_DEPTH a visitor finishes the subtree with
+* walkExpression, which bounds native recursion for any input.
+*/
+class ExpressionDepth {
+ public:
+    ExpressionDepth() {
+        depth_++;
+    }
+    ~ExpressionDepth() {
+        depth_--;
+    }
+    bool exceeded() const {
+        return depth_ > MAX_NATIVE_DEPTH;
+    }
+
+    static constexpr unsigned MAX_NATIVE_DEPTH = 512;
+
+ private:
+    static thread_local unsigned depth_;
+};
+
+/*
+* Counts the statements and procedure calls an interpreter has recursed
+* into on this thread. Parsing bounds the nesting of statements, only
+* calls can go deeper without end, so a call checks exceeded() and
+* aborts the run instead of overflowing the native stack.
+*/
+class StatementDepth {
+ public:
+    StatementDepth() {
+        depth_++;
+    }
+    ~StatementDepth() {
+        depth_--;
+    }
+    bool exceeded() const {
+        return depth_ > MAX_NATIVE_DEPTH;
+    }
+    unsigned depth() const {
+        return depth_;
+    }
+
+    static constexpr unsigned MAX_NATIVE_DEPTH = 8192;
+
+ private:
+    static thread_local unsigned depth_;
+};
+
+/*
+* Post-order walk of an expression on an explicit stack: leaf(AST&) for
+* every Num and Var, unary(UnaryOp&) and binary(BinOp&) once their operands
+* are done. Operands are visited left to right.
+*/
+template <typename Leaf, typename Unary, typename Binary>
+void walkExpression(AST& root, Leaf&& leaf, Unary&& unary, Binary&& binary) {
+    // an operator is pushed again, marked as expanded, below its operands
+    std::vector<std::pair<AST*, bool>> stack{{&root, false}};
+    while (!stack.empty()) {
+        auto [node, expanded] = stack.back();
+        stack.pop_back();
+        if (BinOp* bo = dynamic_cast<BinOp*>(node)) {
+            if (expanded) {
+                binary(*bo);
+            } else {
+                stack.push_back({node, true});
+                stack.push_back({bo->right_, false});
+                stack.push_back({bo->left_, false});
+            }
+        } else if (UnaryOp* uo = dynamic_cast<UnaryOp*>(node)) {
+            if (expanded) {
+                unary(*uo);
+            } else {
+                stack.push_back({node, true});
+                stack.push_back({uo->expr_, false});
+            }
+        } else {
+            leaf(*node);
+        }
+    }
+}
+
 class Parser {
  public:
-    Parser(std::unique_ptr<Lexer>&& lexer);
+    /*
+    * pipelined moves the lexer onto its own thread, see TokenPipeline.
+    * Nodes are made in arena when given, otherwise they are never freed.
+    */
+    Parser(std::unique_ptr<Lexer>&& lexer, bool pipelined = false, Arena* arena = nullptr);
 
     void error() {
-        throw std::runtime_error("Invalid syntax");
+        throw SourceError(currentToken_ != nullptr ? currentToken_->offset_ : 0, "Invalid syntax");
     }
 
     /*
@@ -442,11 +1240,35 @@ class Parser {
 
     /*
     *     statement : compound_statement
+    *          | proccall_statement
     *          | assignment_statement
+    *          | while_statement
+    *          | for_statement
     *          | empty
     */
     AST* statement();
 
+    /*
+    * while_statement : WHILE condition DO statement
+    */
+    AST* whileStatement();
+
+    /*
+    * for_statement : FOR variable ASSIGN expr TO expr DO statement
+    */
+    AST* forStatement();
+
+    /*
+    * condition : expr (EQUAL | NOT_EQUAL | LESS | LESS_EQUAL | GREATER | GREATER_EQUAL) expr
+    * Comparisons only appear here, not inside an expr.
+    */
+    AST* condition();
+
+    /*
+    * proccall_statement : ID LPAREN RPAREN
+    */
+    AST* proccallStatement();
+
     /*
     * assignment_statement : variable ASSIGN expr
     */
@@ -463,25 +1285,13 @@ class Parser {
     AST* empty();
 
     /*
-     * factor : PLUS factor
-     *             | MINUS factor
-     *             | INTEGER_CONST
-     *             | REAL_CONST
-     *             | LPAREN expr RPAREN
-     *             | variable
-    */
-    AST* factor();
-
-    /*
-    * term : factor ((MUL | INTEGER_DIV | FLOAT_DIV) factor)*
-    */
-    AST* term();
-
-    /*
-    * Arithmetic expression parser / interpreter.
+    * Arithmetic expression parser.
     *    expr   : term ((PLUS | MINUS) term)*
-    *    term   : factor ((MUL | DIV) factor)*
-    *    factor : (PLUS | MINUS) factor | INTEGER | LParen expr RParen
+    *    term   : factor ((MUL | INTEGER_DIV | FLOAT_DIV) factor)*
+    *    factor : (PLUS | MINUS) factor | INTEGER_CONST | REAL_CONST | LPAREN expr RPAREN | variable
+    * Parsed by precedence climbing in one loop driven by BINDING_POWERS: the
+    * operands and operators of all open levels wait on heap stacks, so
+    * nesting depth costs no native stack.
     */
     AST* expr();
 
@@ -510,15 +1320,159 @@ class Parser {
 
     AST* parse() {
         AST* node = program();
-        if (currentToken_.type_ != TokenType::TYPE_EOF) {
+        if (currentToken_->type_ != TokenType::TYPE_EOF) {
+            error();
+        }
+        return node;
+    }
+
+    /*
+    * The input is exactly one block, e.g. the body of a procedure.
+    */
+    Block* parseBlock() {
+        Block* node = block();
+        if (currentToken_->type_ != TokenType::TYPE_EOF) {
             error();
         }
         return node;
     }
 
+    /*
+    * Token k positions ahead of the current one (k = 0),
+    * k must be smaller than TokenRing::CAPACITY.
+    */
+    const Token& peek(size_t k);
+
+    /*
+    * Statements and blocks are parsed, and later visited, recursively on
+    * the native stack. Deeper nesting is a syntax error rather than a
+    * stack overflow, which matters to a server running untrusted text.
+    */
+    static constexpr unsigned MAX_NESTING = 256;
+
  private:
+    void fillTokens();
+
+    // one level deeper, throws past MAX_NESTING
+    void enterNesting();
+
+    template <typename T, typename... Args>
+    T* make(Args&&... args) {
+        if (arena_ != nullptr) {
+            return arena_->make<T>(std::forward<Args>(args)...);
+        }
+        return new T(std::forward<Args>(args)...);
+    }
+
+    /*
+    * How tightly a token binds as a prefix and as an infix operator, 0 when
+    * it is no operator in that position. Equal infix powers associate to the
+    * left. A new operator only needs an entry in BINDING_POWERS.
+    */
+    struct BindingPower {
+        uint8_t prefix;
+        uint8_t infix;
+    };
+    typedef std::array<BindingPower, static_cast<size_t>(TokenType::TYPE_EOF) + 1> BindingPowers;
+    static const BindingPowers BINDING_POWERS;
+    static constexpr BindingPowers makeBindingPowers();
+
+    static const BindingPower& bindingPower(TokenType type) {
+        return BINDING_POWERS[static_cast<size_t>(type)];
+    }
+
+    struct PendingOperator {
+        Token token;
+        uint8_t power;    // 0 for an open paren
+        bool prefix;
+    };
+
+    // turn the top operator and its operands into a node
+    void reduce();
+
     std::unique_ptr<Lexer> lexer_;
-    Token currentToken_;
+    std::unique_ptr<TokenPipeline> pipeline_;
+    Arena* arena_ = nullptr;
+    std::vector<AST*> operands_;
+    std::vector<PendingOperator> operators_;
+    TokenRing tokens_;
+    Token* currentToken_ = nullptr;   // always the front of tokens_
+    unsigned nesting_ = 0;            // statements and blocks open
+};
+
+/*
+* Byte ranges of one top-level PROCEDURE declaration in the program text.
+*/
+struct ProcedureExtent {
+    Atom name;
+    size_t declBegin;   // the PROCEDURE keyword
+    size_t blockBegin;  // after "PROCEDURE ID ;"
+    size_t blockEnd;    // after the END of the block
+    size_t declEnd;     // after the closing SEMI
+};
+
+/*
+* Fast pre-scan of program text that only recognizes words, comments and
+* the ';' and '.' separators. It finds the extent of every top-level
+* procedure by matching BEGIN/END nesting: nested procedures come before
+* the body of their parent, so the END that brings the nesting back to
+* zero closes the innermost open procedure. Scanning stops at the BEGIN
+* of the main compound statement.
+*/
+class ProcedureScanner {
+ public:
+    ProcedureScanner(const char* text, size_t size) : text_(text), size_(size) {}
+
+    std::vector<ProcedureExtent> scan();
+
+ private:
+    enum class Word { Procedure, Begin, End, Semi, Other, Eof };
+
+    Word next();
+
+    const char* text_;
+    size_t size_;
+    size_t pos_ = 0;
+    size_t wordBegin_ = 0;
+};
+
+/*
+* Front end for programs with many top-level procedures. The procedure
+* blocks found by ProcedureScanner are parsed on the pool, each into its own
+* arena, while the rest of the program is parsed with the procedures blanked
+* out. The ProcedureDecl nodes are then appended to the program block in
+* source order (the grammar puts them after all variable declarations).
+* The tree lives as long as the ParallelParser.
+*/
+class ParallelParser {
+ public:
+    ParallelParser(std::string&& text, ThreadPool& pool) : text_(std::move(text)), pool_(pool) {}
+
+    Program* parse();
+
+ private:
+    std::string text_;
+    ThreadPool& pool_;
+    std::vector<std::unique_ptr<Arena>> arenas_;
+};
+
+/*
+* Front end that leaves the blocks of top-level procedures unparsed. Only
+* their extents are found by ProcedureScanner; a block is parsed into its
+* own arena on the first call (ProcedureDecl::body) or when a full check
+* visits it, so startup scales with the code that actually runs.
+* The tree lives as long as the LazyParser.
+*/
+class LazyParser {
+ public:
+    explicit LazyParser(std::string&& text) : text_(std::move(text)) {}
+
+    Program* parse();
+
+ private:
+    std::string text_;
+    Arena arena_;
+    std::vector<std::unique_ptr<LazyBlock>> blocks_;
 };
 
 /*********************************************************************************************************************
@@ -528,33 +1482,41 @@ class Parser {
 **********************************************************************************************************************/
 class Symbol {
  public:
-    Symbol(std::string& name, BuiltinTypeSymbol* type = nullptr) :
+    Symbol(Atom name, BuiltinTypeSymbol* type = nullptr) :
         name_(name), type_(type) {}
         
     virtual bool isBuiltinTypeSymbol() {
         return false;
     }
     virtual std::string getPrettyPrintedString() = 0;
-    std::string name_;
+    Atom name_;
     BuiltinTypeSymbol* type_;
 };
 
 class BuiltinTypeSymbol : public Symbol {
  public:
-    BuiltinTypeSymbol(std::string&& name) : Symbol(name) {}
+    BuiltinTypeSymbol(std::string&& name) : Symbol(Interner::intern(name)) {}
     std::string getPrettyPrintedString() final {
-        return name_;
+        return Interner::name(name_);
     }
     bool isBuiltinTypeSymbol() {
         return true;
     }
 };
 
+class ProcedureSymbol : public Symbol {
+ public:
+    ProcedureSymbol(Atom name) : Symbol(name) {}
+    std::string getPrettyPrintedString() final {
+        return "<" + Interner::name(name_) + ":PROCEDURE>";
+    }
+};
+
 class VarSymbol : public Symbol {
  public:
-    VarSymbol(std::string& name, BuiltinTypeSymbol* type) : Symbol(name, type) {}
+    VarSymbol(Atom name, BuiltinTypeSymbol* type) : Symbol(name, type) {}
     std::string getPrettyPrintedString() final {
-        return "<" + name_ + ":" + type_->getPrettyPrintedString() + ">";
+        return "<" + Interner::name(name_) + ":" + type_->getPrettyPrintedString() + ">";
     }
 };
 
@@ -563,9 +1525,111 @@ class VarSymbol : public Symbol {
  * INTERPRETER
  * 
 **********************************************************************************************************************/
+/*
+* Variables a statement reads and writes, collected from its Var nodes.
+* A procedure call may touch anything and makes the statement a barrier.
+*/
+class AccessCollector : public NodeVisitor {
+ public:
+    int visit(BinOp& bo) override;
+    int visit(Num& num) override {
+        return 0;
+    }
+    int visit(UnaryOp& uo) override;
+    void visit(Compound& comp) override;
+    void visit(Assign& as) override;
+    int visit(Var& var) override;
+    void visit(NoOp& noop) override {}
+    void visit(ProcedureCall& pc) override {
+        barrier_ = true;
+    }
+    void visit(While& loop) override {
+        barrier_ = true;
+    }
+    void visit(For& loop) override {
+        barrier_ = true;
+    }
+
+    std::vector<Atom> reads_;
+    std::vector<Atom> writes_;
+    bool barrier_ = false;
+};
+
+/*
+* Execution plan for the children of a Compound. Procedure calls split them
+* into segments. Inside a segment the read/write dependencies (RAW, WAR, WAW)
+* form a DAG that is cut into levels: the statements of one level touch
+* disjoint variables, apart from shared reads, and only depend on statements
+* of earlier levels.
+*/
+struct StatementSchedule {
+    struct Segment {
+        std::vector<AST*> statements;             // source order
+        std::vector<std::vector<Atom>> reads;     // per statement
+        std::vector<std::vector<Atom>> writes;    // per statement
+        std::vector<std::vector<AST*>> levels;
+        bool barrier = false;                     // one procedure call
+    };
+
+    static std::unique_ptr<StatementSchedule> build(Compound& comp);
+
+    std::vector<Segment> segments;
+};
+
+/*
+* Bounds for running programs we do not trust. Steps are statements.
+* maxDepth bounds the statements and calls nested at a call, it cannot
+* go past StatementDepth::MAX_NATIVE_DEPTH.
+*/
+struct ExecutionLimits {
+    uint64_t maxSteps = UINT64_MAX;
+    std::chrono::milliseconds timeout{0};  // 0 for none
+    unsigned maxDepth = StatementDepth::MAX_NATIVE_DEPTH;
+};
+
+/*
+* Thrown when a run exceeds its ExecutionLimits.
+*/
+class ExecutionAborted : public SourceError {
+ public:
+    enum class Reason {
+        StepBudget,
+        Deadline,
+        CallDepth
+    };
+
+    /*
+    * offset is that of the statement.
+    */
+    ExecutionAborted(Reason reason, uint64_t steps, const std::string& statement, uint32_t offset);
+
+    Reason reason() const {
+        return reason_;
+    }
+    uint64_t steps() const {
+        return steps_;
+    }
+    /*
+    * The statement that was about to run.
+    */
+    const std::string& statement() const {
+        return statement_;
+    }
+
+ private:
+    Reason reason_;
+    uint64_t steps_;
+    std::string statement_;
+};
+
 class Interpreter : public NodeVisitor {
  public: 
     explicit Interpreter(std::unique_ptr<Parser> parser) : parser_(std::move(parser)) {}
+    /*
+    * With a pool, long Compounds run their independent statements
+    * concurrently, see StatementSchedule.
+    */
+    explicit Interpreter(ThreadPool* pool = nullptr) : pool_(pool) {}
     int visit(BinOp& bo) override;
     int visit(UnaryOp& uo) override;
     int visit(Num& num) override;
@@ -578,20 +1642,1130 @@ class Interpreter : public NodeVisitor {
     void visit(Block& blk) override;
     void visit(VarDecl& vDecl) override;
     void visit(Type& tp) override;
-
+    void visit(ProcedureDecl& pd) override;
+    /*
+    * There are no activation records yet, the body runs against GLOBAL_SCOPE.
+    * A call nested deeper than ExecutionLimits::maxDepth aborts the run.
+    */
+    void visit(ProcedureCall& pc) override;
+    /*
+    * Every test charges a step. After osrThreshold back edges of a loop,
+    * counted on the node, the loop goes on in its compiled form from the
+    * next test (on-stack replacement).
+    */
+    void visit(While& loop) override;
+    /*
+    * Counts in a local, charging a step per iteration and one for the
+    * test that ends the loop, and goes on in the compiled form like a
+    * WHILE once the loop is hot.
+    */
+    void visit(For& loop) override;
 
     int interpret() {
         AST* tree = parser_->parse();
+        return interpret(tree);
+    }
+
+    /*
+    * Run a tree that was not produced by our own parser,
+    * e.g. one restored from a binary image.
+    */
+    int interpret(AST* tree) {
         if (tree == nullptr) {
             return -1;
         }
         return tree->accept(*this);
     }
 
-    void printGlobalScope();
+    /*
+    * only lists the variables to print, empty prints all of them.
+    */
+    void printGlobalScope(std::ostream& out = std::cout, const std::vector<Atom>& only = {});
+
+    /*
+    * The deadline starts counting now.
+    */
+    void setLimits(const ExecutionLimits& limits);
+
+    uint64_t steps() const {
+        return steps_.load(std::memory_order_relaxed);
+    }
+
+    /*
+    * Assignments and procedure calls executed so far.
+    */
+    uint64_t statementsExecuted() const {
+        return statementsExecuted_.load(std::memory_order_relaxed);
+    }
+
+    /*
+    * Preset a variable before interpret(), e.g. an input of a parameter sweep.
+    */
+    void setVariable(Atom name, int value) {
+        GLOBAL_SCOPE[name] = value;
+    }
+
+    /*
+    * NO_OSR keeps every loop in the interpreter.
+    */
+    void setOsrThreshold(uint32_t backEdges) {
+        osrThreshold_ = backEdges;
+    }
+
+    /*
+    * Optimizes the loops this interpreter compiles first, see
+    * Loop::compiled.
+    */
+    void setPeephole(PeepholeOptimizer* peephole) {
+        peephole_ = peephole;
+    }
+
+    static constexpr uint32_t OSR_THRESHOLD = 1000;
+    static constexpr uint32_t NO_OSR = UINT32_MAX;
+
+    // below this many statements a segment is not worth the scheduling
+    static constexpr size_t PARALLEL_MIN_STATEMENTS = 64;
+    static constexpr size_t PARALLEL_MIN_CHUNK = 16;
 
  private:
+    void runParallel(Compound& comp);
+    void runSegment(StatementSchedule::Segment& segment);
+    int evaluateIteratively(AST& expr);
+    // entry gives the first slots, the counter and bound of a FOR entered
+    void execute(const Bytecode& code, std::initializer_list<int> entry = {});
+    /*
+    * Account for steps before statement runs. A block charges all of its
+    * statements on entry unless a check is due inside it, so the common
+    * case is one add and one compare per block.
+    */
+    void charge(uint64_t steps, AST* statement) {
+        uint64_t total = steps_.fetch_add(steps, std::memory_order_relaxed) + steps;
+        if (total > nextCheck_.load(std::memory_order_relaxed)) {
+            checkLimits(total, statement);
+        }
+    }
+    void checkLimits(uint64_t total, AST* statement);
+
+    // how often the clock is read when there is a deadline
+    static constexpr uint64_t DEADLINE_CHECK_STEPS = 256;
+
     std::unique_ptr<Parser> parser_;
+    ThreadPool* pool_ = nullptr;
+    // only changed by the thread that schedules, outside of parallel runs
+    bool inParallelRegion_ = false;
+    // statements of a parallel segment count concurrently
+    std::atomic<uint64_t> statementsExecuted_{0};
+    std::atomic<uint64_t> steps_{0};
+    std::atomic<uint64_t> nextCheck_{UINT64_MAX};
+    uint64_t maxSteps_ = UINT64_MAX;
+    unsigned maxDepth_ = StatementDepth::MAX_NATIVE_DEPTH;
+    bool hasDeadline_ = false;
+    std::chrono::steady_clock::time_point deadline_;
+    std::unordered_map<Compound*, std::unique_ptr<StatementSchedule>> schedules_;
+    uint32_t osrThreshold_ = OSR_THRESHOLD;
+    PeepholeOptimizer* peephole_ = nullptr;
+
+    AtomMap<int> GLOBAL_SCOPE;
+    AtomMap<ProcedureDecl*> PROCEDURES;
+};
+
+/*
+* Attributes execution to source lines within procedure call stacks.
+* Count mode counts every statement executed. Sample mode lets a
+* SIGPROF timer look at the current stack every interval of CPU time,
+* which costs the run next to nothing. Both write folded stacks
+* ("Main:20;Alpha:14 37", one line per stack) for flame graph tools.
+* Each frame is a procedure and the line it is executing. Positions are
+* kept as source offsets and only turned into lines for the output.
+*/
+class Profiler {
+ public:
+    enum class Mode {
+        Count,
+        Sample
+    };
 
-    std::unordered_map<std::string, int> GLOBAL_SCOPE;
-};
\ No newline at end of file
+    explicit Profiler(Mode mode, std::chrono::microseconds interval = std::chrono::microseconds(1000));
+    ~Profiler();
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    /*
+    * Only one profiler can sample at a time.
+    */
+    void start(Atom program);
+    void stop();
+
+    void statement(uint32_t offset) {
+        uint32_t depth = depth_.load(std::memory_order_relaxed);
+        frames_[depth - 1].offset.store(offset, std::memory_order_relaxed);
+        if (mode_ == Mode::Count) {
+            context_->counts[offset]++;
+        }
+    }
+    void enter(Atom procedure);
+    void leave();
+
+    void writeFolded(std::ostream& out, const SourceMap& source);
+
+    size_t droppedSamples() const {
+        return dropped_.load();
+    }
+
+    static constexpr uint32_t MAX_DEPTH = 256;
+    static constexpr size_t SAMPLE_BUFFER_WORDS = 1 << 22;
+
+ private:
+    // frames are read from the signal handler, so every field is a lock-free atomic
+    struct Frame {
+        std::atomic<Atom> procedure{NO_ATOM};
+        std::atomic<uint32_t> offset{0};
+    };
+
+    // calling context of count mode
+    struct Context {
+        Context* parent = nullptr;
+        Atom procedure = NO_ATOM;
+        uint32_t callOffset = 0;  // in the parent
+        std::unordered_map<uint32_t, uint64_t> counts;
+        std::map<std::pair<uint32_t, Atom>, std::unique_ptr<Context>> children;
+    };
+
+    static void onSignal(int);
+    void takeSample();
+    void foldContext(const Context& context, const std::string& prefix, const SourceMap& source,
+                     std::map<std::string, uint64_t>& stacks);
+
+    Mode mode_;
+    std::chrono::microseconds interval_;
+    bool running_ = false;
+
+    Frame frames_[MAX_DEPTH];
+    std::atomic<uint32_t> depth_{0};
+    uint32_t hiddenFrames_ = 0;  // calls deeper than MAX_DEPTH
+
+    Context root_;
+    Context* context_ = &root_;
+
+    // samples as [depth, procedure, offset, procedure, offset, ...]
+    std::vector<uint32_t> samples_;
+    // written by the signal handler
+    std::atomic<size_t> sampleWords_{0};
+    std::atomic<size_t> dropped_{0};
+    static_assert(std::atomic<size_t>::is_always_lock_free, "the sample counters are used in a signal handler");
+};
+
+/*
+* Interpreter that reports every statement and call to a Profiler.
+*/
+class ProfilingInterpreter : public Interpreter {
+ public:
+    // compiled loops would hide their statements from the profile
+    explicit ProfilingInterpreter(Profiler& profiler) : profiler_(profiler) {
+        setOsrThreshold(NO_OSR);
+    }
+
+    using Interpreter::visit;
+    void visit(Program& prog) override;
+    void visit(Assign& as) override;
+    void visit(NoOp& noop) override;
+    void visit(ProcedureCall& pc) override;
+    void visit(While& loop) override;
+    void visit(For& loop) override;
+
+ private:
+    Profiler& profiler_;
+};
+
+class LanesDiverged : public SourceError {
+ public:
+    explicit LanesDiverged(uint32_t offset) : SourceError(offset, "the lanes of a loop diverge") {}
+};
+
+/*
+* Runs one program over many sets of initial values at once. Every variable
+* holds one value per instance (a lane) and every operation works on all
+* lanes together, which the compiler maps onto SIMD registers: AVX-512 or
+* AVX2 when the build enables them (-march), plain scalar code otherwise.
+* Control flow is the same for every instance, so whether a variable is
+* defined does not differ between lanes. A WHILE whose test, or a FOR
+* whose bounds, differ between lanes throws LanesDiverged.
+*/
+class LaneInterpreter : public NodeVisitor {
+ public:
+#if defined(__AVX512F__)
+    static constexpr size_t LANES = 16;
+#else
+    static constexpr size_t LANES = 8;
+#endif
+    typedef int Lanes __attribute__((vector_size(LANES * sizeof(int))));
+    typedef float FloatLanes __attribute__((vector_size(LANES * sizeof(float))));
+
+    typedef std::vector<std::pair<Atom, int>> Scope;
+
+    /*
+    * Run tree once per row, row[i] is the initial value of inputs[i].
+    * Returns the final global scope of every instance, sorted by name.
+    */
+    std::vector<Scope> run(AST* tree, const std::vector<Atom>& inputs,
+                           const std::vector<std::vector<int>>& rows);
+
+    int visit(BinOp& bo) override;
+    int visit(UnaryOp& uo) override;
+    int visit(Num& num) override;
+    void visit(Compound& comp) override;
+    void visit(Assign& as) override;
+    int visit(Var& var) override;
+    void visit(NoOp& noop) override {}
+
+    void visit(Program& prog) override;
+    void visit(Block& blk) override;
+    void visit(VarDecl& vDecl) override {}
+    void visit(Type& tp) override {}
+    void visit(ProcedureDecl& pd) override;
+    void visit(ProcedureCall& pc) override;
+    void visit(While& loop) override;
+    void visit(For& loop) override;
+
+ private:
+    // the value of expr, the same in every lane
+    int uniform(AST& expr, uint32_t offset);
+    // result_ = left op right, op is the operator token
+    void combine(const Token& op, const Lanes& left, const Lanes& right);
+    void evaluateIteratively(AST& expr);
+
+    Lanes result_;    // value of the last expression visited
+    AtomMap<Lanes> scope_;
+    AtomMap<ProcedureDecl*> procedures_;
+};
+
+/*********************************************************************************************************************
+ * 
+ * OPTIMIZER
+ * 
+**********************************************************************************************************************/
+/*
+* Common subexpression elimination by value numbering, one run of
+* assignments at a time. BinOp/UnaryOp subtrees get equal numbers when they
+* compute the same operator over equal numbers (+ and * commute), and a
+* variable gets a new number whenever it is assigned, so equal numbers mean
+* equal values. A repeated subtree is computed once into a hidden temporary
+* ($t1, $t2, ...), assigned right before the statement of its first
+* occurrence; the other occurrences read the temporary. Procedure calls,
+* nested Compounds and loops may assign anything and end a run; the
+* statements of a loop body form runs of their own.
+* New nodes live as long as the pass.
+*/
+class CommonSubexpressions {
+ public:
+    void run(Program& prog);
+
+    /*
+    * BinOp/UnaryOp nodes that are no longer evaluated.
+    */
+    size_t eliminated() const {
+        return eliminated_;
+    }
+    size_t temporaries() const {
+        return temporaries_;
+    }
+
+    /*
+    * Names of the temporaries start with '$', which no identifier can.
+    */
+    static bool isTemporary(Atom name) {
+        return Interner::name(name)[0] == '$';
+    }
+
+ private:
+    typedef std::list<AST*>::iterator Statement;
+
+    // numbers of a run stay below 2^29, so an operation fits one map key
+    static constexpr uint32_t MAX_NUMBERS = 1u << 29;
+
+    static uint64_t key(TokenType op, uint32_t left, uint32_t right) {
+        return static_cast<uint64_t>(op) << 58 | static_cast<uint64_t>(left) << 29 | right;
+    }
+
+    /*
+    * A BinOp/UnaryOp of the run. Operators are kept in post-order, so the
+    * operators of a subtree are the size entries ending at its root.
+    */
+    struct Operator {
+        AST** slot;       // where the parent points to it
+        uint32_t number;
+        uint32_t size;
+    };
+
+    void optimize(Block& blk);
+    void optimize(Compound& comp);
+    void optimizeRun(Compound& comp, Statement begin, Statement end);
+    // appends the operators of expr, returns its number
+    uint32_t number(AST*& expr);
+    uint32_t newNumber();
+
+    Arena arena_;
+    size_t eliminated_ = 0;
+    size_t temporaries_ = 0;
+
+    // state of the current run, numbers start from 1 in every run
+    AtomMap<uint32_t> variables_;
+    AtomMap<uint32_t, uint64_t> literals_;       // by value
+    AtomMap<uint32_t, uint64_t> expressions_;    // by key(), right is 0 for a UnaryOp
+    std::vector<Operator> operators_;
+    std::vector<size_t> occurrences_;    // by number, of the operators still evaluated
+    std::vector<Atom> temporaryOf_;      // by number
+};
+
+/*
+* Dead store elimination. Liveness runs backwards over the statements of a
+* block, through nested Compounds. At the end of the program every variable
+* is live, since printGlobalScope shows it, except the temporaries of
+* CommonSubexpressions, or only the outputs when they are given. A procedure
+* call, and the end of a procedure body, may read anything, but only
+* variables that are shown or feed one that is can be needed at all.
+* Removing stores can leave others unneeded, so this repeats until nothing
+* changes.
+* An assignment is only removed when its right side cannot fault: no
+* division by anything but a nonzero literal and no read of a variable
+* that is not surely assigned before, so removing the store cannot hide
+* an error. Loops are left alone and read everything. Declarations of
+* variables no longer mentioned anywhere go too.
+*/
+class DeadStores {
+ public:
+    explicit DeadStores(std::vector<Atom> outputs = {}) : outputs_(std::move(outputs)) {}
+
+    void run(Program& prog);
+
+    size_t removedStores() const {
+        return removedStores_;
+    }
+    size_t removedDeclarations() const {
+        return removedDeclarations_;
+    }
+
+ private:
+    /*
+    * Every variable except those in except, or only those in live.
+    */
+    struct Liveness {
+        bool all = false;
+        AtomMap<bool> except;
+        AtomMap<bool> live;
+
+        void everything() {
+            all = true;
+            except = AtomMap<bool>();
+        }
+        bool contains(Atom name) {
+            bool* found = all ? except.find(name) : live.find(name);
+            return all ? found == nullptr || !*found : found != nullptr && *found;
+        }
+        void kill(Atom name) {
+            (all ? except[name] : live[name]) = all;
+        }
+        void gen(Atom name) {
+            (all ? except[name] : live[name]) = !all;
+        }
+    };
+
+    void findSafe(Block& blk);
+    void findSafe(Compound& comp, AtomMap<bool>& assigned);
+    void findNeeded(Program& prog);
+    template <typename F>
+    void findSources(Block& blk, F& need);
+    template <typename F>
+    void findSources(Compound& comp, F& need);
+    void removeStores(Block& blk, bool program);
+    void removeStores(Compound& comp, Liveness& live);
+    void collectNames(Block& blk, AtomMap<bool>& names);
+    void collectNames(Compound& comp, AtomMap<bool>& names);
+    void collectNames(AST& statement, AtomMap<bool>& names);
+    void removeDeclarations(Block& blk, AtomMap<bool>& names);
+
+    std::vector<Atom> outputs_;
+    AtomMap<std::vector<Atom>> sources_;    // variables read by the stores to a variable
+    AtomMap<bool> needed_;
+    std::unordered_set<Assign*> safe_;      // cannot fault
+    size_t removedStores_ = 0;
+    size_t removedDeclarations_ = 0;
+};
+
+/*********************************************************************************************************************
+ * 
+ * MID-LEVEL IR
+ * 
+**********************************************************************************************************************/
+/*
+* SSA form of the statements of one block, nested Compounds flattened.
+* Every instruction defines at most one value, named by its index, and its
+* operands name earlier values. Variables are no values: Load reads one,
+* Store writes one and a Call or a Loop may read and write all of them.
+* The body of a loop, when a compound statement, is a function of its
+* own. Within a run without calls a read of a variable is the value last
+* stored to it, so each assignment x := e defines a new version of x as a
+* Copy of e.
+* Passes rewrite instructions in place and turn removed ones into Nop, so
+* value names never change.
+*/
+enum class IROp : uint8_t {
+    Const,          // value
+    Load,           // var
+    Store,          // var := a
+    Copy,           // a
+    Neg,            // -a
+    Add,            // a op b
+    Sub,
+    Mul,
+    IntegerDiv,
+    FloatDiv,
+    Call,           // procedure var
+    Loop,           // loops[value] of the function
+    Nop
+};
+
+struct IRInstruction {
+    static constexpr uint32_t NO_VALUE = UINT32_MAX;
+
+    IROp op;
+    uint32_t a = NO_VALUE;
+    uint32_t b = NO_VALUE;
+    Atom var = NO_ATOM;
+    int value = 0;
+    uint32_t offset = 0;    // in the source
+
+    /*
+    * A division by anything but a constant that cannot trap may fault
+    * and stays even when its value is unused.
+    */
+    bool mayFault(const std::vector<IRInstruction>& code) const;
+};
+
+struct IRFunction {
+    Atom name;
+    Compound* target;       // lowered back into its statements
+    Loop* loop;             // whose body target is, if any
+    std::vector<IRInstruction> code;
+    std::vector<Loop*> loops;
+
+    size_t size() const;    // without Nops
+    void print(std::ostream& out) const;
+};
+
+/*
+* Builds one IRFunction for the program and for every procedure, nested
+* ones first, each followed by those of its loop bodies.
+*/
+class IRBuilder {
+ public:
+    std::vector<IRFunction> build(Program& prog);
+
+ private:
+    void build(Block& blk, Atom name, std::vector<IRFunction>& functions);
+    void build(Compound& comp, Atom name, Loop* loop, std::vector<IRFunction>& functions);
+    void append(Compound& comp, IRFunction& fn, std::vector<Loop*>& bodies);
+    uint32_t expression(AST& expr, IRFunction& fn);
+    uint32_t emit(IRFunction& fn, IRInstruction instruction);
+
+    AtomMap<uint32_t> versions_;    // current value of each variable since the last call
+};
+
+class IRPass {
+ public:
+    virtual ~IRPass() = default;
+    virtual const char* name() const = 0;
+    // returns how many instructions it changed
+    virtual size_t run(IRFunction& fn) = 0;
+};
+
+/*
+* Folds operators over constants. Divisions that would trap stay.
+*/
+class ConstantPropagation : public IRPass {
+ public:
+    const char* name() const override {
+        return "constprop";
+    }
+    size_t run(IRFunction& fn) override;
+};
+
+/*
+* Makes every operand that is a Copy name what is copied.
+*/
+class CopyPropagation : public IRPass {
+ public:
+    const char* name() const override {
+        return "copyprop";
+    }
+    size_t run(IRFunction& fn) override;
+};
+
+/*
+* Removes unused values that cannot fault and stores that are stored over
+* before any call, loop or load of the variable. Every variable is read at
+* the end, by printGlobalScope, the caller or the loop. A Load only cannot
+* fault when the variable was surely stored to before.
+*/
+class DeadCodeElimination : public IRPass {
+ public:
+    const char* name() const override {
+        return "dce";
+    }
+    size_t run(IRFunction& fn) override;
+};
+
+/*
+* Runs passes in order over every function, timing each one, and prints
+* the IR after building and after each pass when asked to.
+*/
+class PassManager {
+ public:
+    struct Timing {
+        const char* pass;
+        std::chrono::nanoseconds time;
+        size_t changed;
+    };
+
+    explicit PassManager(std::ostream* dump = nullptr) : dump_(dump) {}
+
+    /*
+    * constprop, copyprop or dce, throws for other names.
+    */
+    static std::unique_ptr<IRPass> create(const std::string& name);
+
+    void add(std::unique_ptr<IRPass> pass) {
+        passes_.push_back(std::move(pass));
+    }
+    void run(std::vector<IRFunction>& functions);
+
+    const std::vector<Timing>& timings() const {
+        return timings_;
+    }
+
+ private:
+    std::ostream* dump_;
+    std::vector<std::unique_ptr<IRPass>> passes_;
+    std::vector<Timing> timings_;
+};
+
+/*
+* Turns every IRFunction back into the statements of its block, so all
+* backends run the optimized program. A value used once becomes part of
+* the tree of its user, one used more often, or unused but faulting, is
+* assigned to a hidden temporary ($v1, $v2, ...) where it is defined.
+* A Load left in a tree reads its variable later than the IR does, so it
+* is copied into a temporary first when a store to the variable, a call
+* or a loop comes before the tree is assigned. Loops stay where they are.
+* New nodes live as long as the lowering.
+*/
+class IRLowering {
+ public:
+    void lower(std::vector<IRFunction>& functions);
+
+    size_t temporaries() const {
+        return temporaries_;
+    }
+
+ private:
+    static constexpr uint32_t PENDING = UINT32_MAX;
+    static constexpr uint32_t DONE = UINT32_MAX - 1;
+
+    // a Var of a Load in a tree and the value whose tree it is in
+    struct LoadUse {
+        Var* node;
+        uint32_t user;
+    };
+
+    void lower(IRFunction& fn);
+    // tree for one use of value by user
+    AST* take(uint32_t value, uint32_t user);
+    // value that user is in the tree of, DONE once that tree is assigned
+    uint32_t root(uint32_t user);
+    void materialize(uint32_t value, AST* tree);
+    // copies loads still in use of var, or of every variable for NO_ATOM
+    void release(Atom var);
+    void releaseLoad(uint32_t load);
+    Atom temporary();
+    Var* variable(Atom name, uint32_t offset);
+    void assign(Atom name, AST* tree, uint32_t offset);
+
+    Arena arena_;
+    size_t temporaries_ = 0;
+
+    // state of the current function
+    const std::vector<IRInstruction>* code_ = nullptr;
+    std::list<AST*> statements_;
+    std::vector<uint32_t> uses_;            // not yet taken
+    std::vector<AST*> trees_;
+    std::vector<uint32_t> users_;           // PENDING until taken
+    std::vector<Atom> temporaryOf_;
+    std::vector<uint32_t> leafOf_;          // Const, Load or temporary a value stands for
+    std::vector<std::vector<LoadUse>> loadUses_;
+    AtomMap<std::vector<uint32_t>> loads_;  // by variable, since its last store
+    std::vector<Atom> loaded_;              // variables with loads_
+};
+
+/*********************************************************************************************************************
+ * 
+ * BYTECODE
+ * 
+**********************************************************************************************************************/
+/*
+* Stack code for hot loops, run by Interpreter::execute. Variables are
+* held in slots while it runs: they are read from the global scope when
+* the code is entered and after a procedure call, and written back before
+* a call and when the code is left. Temporaries, the counters and bounds
+* of FOR loops and the products that step with them, are slots without a
+* variable.
+*/
+enum class Opcode : uint8_t {
+    Push,           // a
+    Load,           // slot a, an error when the variable is not defined
+    Store,          // slot a
+    Tee,            // slot a, keeps the value
+    Neg,
+    Add,
+    Sub,
+    Mul,
+    Div,            // a is the source offset, an error on a zero divisor or overflow
+    FloatDiv,
+    Shl,            // by a, wrapping
+    DivPow2,        // by 2 ** a, truncating
+    DivMagic,       // by the divisor of DivisionMagic{a, b}
+    Equal,          // 1 or 0
+    NotEqual,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    JumpIfFalse,    // to a
+    Loop,           // back edge to a, charges loops[b]
+    Next,           // back edge of the FOR loops[b] to a, unless its counter reached the bound
+    Step,           // slot a += b, wrapping
+    Call,           // calls[a], run by the interpreter
+    Exit,
+    Nop,            // removed by the peephole optimizer, never run
+};
+
+struct Instruction {
+    Opcode op;
+    int32_t a = 0;
+    int32_t b = 0;
+};
+
+/*
+* Division by a constant as a multiply-high and shifts (Hacker's Delight,
+* 10-4), truncating toward zero like DIV. Only for divisors of 3 and more
+* that are no power of two, a negative divisor divides by its absolute
+* value and negates.
+*/
+struct DivisionMagic {
+    int32_t multiplier;
+    int32_t shift;
+
+    static DivisionMagic of(int32_t divisor);
+
+    int32_t divide(int32_t n) const {
+        int32_t q = static_cast<int32_t>((static_cast<int64_t>(multiplier) * n) >> 32);
+        if (multiplier < 0) {
+            q += n;
+        }
+        q >>= shift;
+        return q + static_cast<int32_t>(static_cast<uint32_t>(n) >> 31);
+    }
+};
+
+struct Bytecode {
+    /*
+    * Steps and statements of one iteration, outside of nested loops,
+    * charged on each back edge. The test that enters a loop nested in
+    * compiled code is not charged.
+    */
+    struct LoopCost {
+        uint32_t steps;
+        uint32_t statements;
+        Loop* loop;
+        uint32_t counter = 0;   // slot of a FOR, its bound is the next one
+    };
+
+    std::vector<Instruction> code;
+    std::vector<Atom> slots;                // variable of each slot
+    std::vector<ProcedureCall*> calls;
+    std::vector<LoopCost> loops;
+    uint32_t maxStack = 0;
+};
+
+/*
+* Compiles a loop into Bytecode that ends with Exit when the loop does. A
+* While is entered at its test, a For at the start of its next iteration,
+* with its counter in slot 0 and its bound in slot 1.
+*
+* In a FOR whose body can change neither the variable nor, by a call,
+* anything else, i * k and k * i for a literal k read a temporary that
+* starts at i * k and steps by k with the counter (strength reduction).
+* When both bounds are constants and the loop runs at least once, a nested
+* FOR skips its entry test.
+*
+* A multiplication by a literal power of two becomes a shift, by 1 or -1
+* nothing or a negation. DIV by a literal becomes a shift or a
+* DivisionMagic, except by 0, -1 and the most negative integer, which keep
+* their trap.
+*/
+class BytecodeCompiler {
+ public:
+    Bytecode compile(Loop& loop);
+
+ private:
+    struct Induction {
+        uint32_t variable;      // slot
+        std::vector<std::pair<int, uint32_t>> products;   // k and the slot of i * k
+    };
+
+    void loop(While& loop);
+    void loop(For& loop, bool entered);
+    // every k of i * k in body, false when i may change there
+    static bool findProducts(AST& body, Atom variable, std::vector<int>& factors);
+    // value of an expression without variables that cannot fault
+    static bool constant(AST& expr, int& value);
+    void statement(AST& node, uint32_t loop);
+    void expression(AST& expr);
+    // a product of an induction variable ends the code emitted
+    bool reduceProduct();
+    // for a MUL or IntegerDiv about to be emitted
+    bool reduceByConstant(TokenType op);
+    uint32_t emit(Opcode op, int32_t a = 0, int32_t b = 0);
+    uint32_t slot(Atom name);
+    uint32_t temporary();
+
+    Bytecode code_;
+    AtomMap<uint32_t> slots_;
+    std::vector<Induction> inductions_;     // of the FOR loops around
+    uint32_t depth_ = 0;    // of the stack after the last instruction
+};
+
+/*
+* Rewrites short windows of compiled code by a table of rules, until none
+* applies. A window never spans a jump target, only its first instruction
+* may be one. Instructions a rule removes become Nop and are dropped
+* after each sweep, with the jumps over them fixed up.
+*
+* The standard rules:
+*   store-load    Store x; Load x          ->  Tee x
+*   negate-push   Push k; Neg              ->  Push -k
+*   negate-twice  Neg; Neg                 ->
+*   fold          Push a; Push b; op       ->  Push a op b, for + - *
+*   fold-unary    Push a; op               ->  Push op a, for shifts and divisions
+*/
+class PeepholeOptimizer {
+ public:
+    struct Rule {
+        const char* name;
+        size_t window;
+        // rewrites window instructions in place, false when they do not match
+        bool (*rewrite)(Instruction* window);
+    };
+
+    struct Statistics {
+        size_t before = 0;      // instructions
+        size_t after = 0;
+        std::vector<size_t> applied;    // per rule
+    };
+
+    static const std::vector<Rule>& standardRules();
+    // with the standard rules, for loops compiled without an optimizer
+    static PeepholeOptimizer& standard();
+
+    // rules over more than maxWindow instructions are left out
+    explicit PeepholeOptimizer(const std::vector<Rule>& rules = standardRules(), size_t maxWindow = SIZE_MAX);
+
+    void run(Bytecode& code);
+
+    const std::vector<Rule>& rules() const {
+        return rules_;
+    }
+
+    /*
+    * Summed over every run, which may happen on several threads.
+    */
+    Statistics statistics() const;
+
+ private:
+    // drops Nops and fixes up jumps
+    static void compact(Bytecode& code);
+
+    std::vector<Rule> rules_;
+    std::atomic<size_t> before_{0};
+    std::atomic<size_t> after_{0};
+    std::unique_ptr<std::atomic<size_t>[]> applied_;
+};
+
+/*********************************************************************************************************************
+ * 
+ * BINARY IMAGE
+ * 
+**********************************************************************************************************************/
+/*
+* Versioned binary image of a Program tree, so a program can be parsed once
+* and shipped to other machines.
+*
+*   header  : magic "P12B", version, root offset, string table offset, image size
+*   nodes   : NodeHeader followed by 4-byte fields, children written before parents
+*   strings : count, (offset, length) pairs, then the bytes
+*
+* Every child reference is an int32 offset relative to the field that holds it,
+* so the image can be mmap'ed anywhere and read without pointer fix-ups.
+* Identifiers and literal texts are stored once in the string table and referred
+* to by index, operators only by their token type. Nodes shared in the tree (the Type of "a, b : INTEGER") stay shared.
+*/
+enum class NodeKind : uint8_t {
+    Program,
+    Block,
+    VarDecl,
+    Type,
+    Compound,
+    Assign,
+    Var,
+    ProcedureDecl,
+    NoOp,
+    BinOp,
+    UnaryOp,
+    Num,
+    ProcedureCall,
+    While,
+    For,
+};
+
+struct ImageHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t rootOffset;
+    uint32_t stringTableOffset;
+    uint32_t imageSize;
+};
+
+struct NodeHeader {
+    NodeKind kind;
+    uint8_t op;         // TokenType of the node's token
+    uint16_t flags;
+    uint32_t source;    // offset of the node in the program text
+};
+
+// referenced from more than one place, the loader must hand out one node
+constexpr uint16_t NODE_SHARED = 1;
+
+constexpr char IMAGE_MAGIC[4] = {'P', '1', '2', 'B'};
+constexpr uint32_t IMAGE_VERSION = 4;
+
+class ASTSerializer : public NodeVisitor {
+ public:
+    std::string serialize(Program& prog);
+
+    int visit(BinOp& bo) override;
+    int visit(Num& num) override;
+    int visit(UnaryOp& uo) override;
+
+    void visit(Compound& cp) override;
+    void visit(Assign& as) override;
+    int visit(Var& var) override;
+    void visit(NoOp& noop) override;
+
+    void visit(Program& prog) override;
+    void visit(Block& blk) override;
+    void visit(VarDecl& vDecl) override;
+    void visit(Type& tp) override;
+    void visit(ProcedureDecl& pd) override;
+    void visit(ProcedureCall& pc) override;
+    void visit(While& loop) override;
+    void visit(For& loop) override;
+
+ private:
+    /*
+    * Serialize node (once) and return its offset in the image.
+    */
+    uint32_t write(AST* node);
+    /*
+    * write() for an expression too deep to recurse into,
+    * shared operator nodes below it are written again.
+    */
+    void writeIteratively(AST& expr);
+    uint32_t beginNode(AST& node, NodeKind kind, TokenType op);
+    void putU32(uint32_t value);
+    void putChild(uint32_t childOffset);
+    uint32_t stringIndex(const std::string& str);
+
+    std::string image_;
+    uint32_t lastOffset_ = 0;
+    std::unordered_map<AST*, uint32_t> written_;
+    std::unordered_map<std::string, uint32_t> stringIndex_;
+    std::vector<const std::string*> strings_;
+};
+
+class ASTLoader {
+ public:
+    ASTLoader(const char* data, size_t size) : data_(data), size_(size) {}
+
+    /*
+    * Rebuild the Program tree stored in the image,
+    * throws if the image is truncated, malformed or of another version.
+    */
+    Program* load();
+
+ private:
+    AST* node(uint32_t offset);
+    AST* build(uint32_t offset);
+    /*
+    * node() for a BinOp/UnaryOp too deep to recurse into.
+    */
+    AST* expression(uint32_t offset);
+    NodeHeader header(uint32_t offset);
+    AST* finish(AST* result, uint32_t offset, const NodeHeader& header);
+    template <typename T>
+    T* node(uint32_t offset, NodeKind kind);
+    uint32_t u32(uint32_t offset);
+    /*
+    * The child referenced at fieldOffset, which must lie between the
+    * image header and parent since children are written first.
+    */
+    uint32_t child(uint32_t parent, uint32_t fieldOffset);
+    // marks a node as loaded, a node that is not shared may be loaded once
+    void claim(uint32_t offset, const NodeHeader& header);
+    Token token(uint32_t nodeOffset, uint32_t stringField);
+    /*
+    * Identifier and keyword tokens are interned again on load.
+    */
+    Token atomToken(uint32_t nodeOffset, uint32_t stringField);
+    /*
+    * Operators are not stored as text, their spelling follows from the token type.
+    */
+    Token opToken(uint32_t nodeOffset);
+    std::string& string(uint32_t index);
+    void error() {
+        throw std::runtime_error("Invalid binary image");
+    }
+
+    const char* data_;
+    size_t size_;
+    Atom atom(uint32_t index);
+
+    std::vector<std::string> strings_;
+    std::vector<Atom> atoms_;
+    std::unordered_map<uint32_t, AST*> shared_;
+    std::vector<bool> loaded_;    // by offset
+
+    // node() recursion: statements nest as deep as the parser allows, a
+    // node for each open statement and block and one per procedure, then
+    // expressions until ExpressionDepth switches to expression()
+    static constexpr uint32_t MAX_DEPTH = 3 * Parser::MAX_NESTING + ExpressionDepth::MAX_NATIVE_DEPTH + 4;
+    uint32_t depth_ = 0;
+};
+
+/*********************************************************************************************************************
+ * 
+ * SERVER
+ * 
+**********************************************************************************************************************/
+/*
+* A parsed and checked program, shared between the cache and the
+* requests that are running it.
+*/
+struct CachedProgram {
+    explicit CachedProgram(size_t arenaLimit) : arena(arenaLimit) {}
+
+    Arena arena;
+    AST* tree = nullptr;
+    std::string text;    // a RUN only reuses the tree for the very same text
+};
+
+/*
+* Programs by id, the least recently used one is dropped when full.
+*/
+class ProgramCache {
+ public:
+    explicit ProgramCache(size_t capacity) : capacity_(capacity) {}
+
+    std::shared_ptr<CachedProgram> find(const std::string& id);
+    void insert(const std::string& id, std::shared_ptr<CachedProgram> program);
+
+ private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<CachedProgram>>> Entries;
+
+    std::mutex mutex_;
+    size_t capacity_;
+    Entries entries_;    // most recently used first
+    std::unordered_map<std::string, Entries::iterator> index_;
+};
+
+/*
+* Long running interpreter on a Unix domain socket. One request per
+* connection: the client writes the request and shuts down its side,
+* the server answers and closes.
+*
+*   RUN\n<program text>   parse, check, cache and run a program
+*   CALL <id>\n           run a cached program again
+*   STOP\n                finish the requests in flight and exit
+*
+* The answer is "OK <id>\n" followed by the global scope, or
+* "ERROR <message>\n". The id is a hash of the program text.
+*
+* One thread runs the epoll loop and does all socket I/O, parsing and
+* interpreting happens on the pool. Workers hand their answers back
+* through a queue and wake the loop with an eventfd.
+*/
+class Server {
+ public:
+    /*
+    * limits apply to every request.
+    */
+    Server(const std::string& socketPath, ThreadPool& pool, const ExecutionLimits& limits = ExecutionLimits());
+    ~Server();
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    /*
+    * Serve until a STOP request.
+    */
+    void run();
+
+    static constexpr size_t MAX_REQUEST = 16 << 20;
+    static constexpr size_t ARENA_LIMIT = 64 << 20;
+    static constexpr size_t CACHE_CAPACITY = 128;
+    // for requests when no --timeout is given, a WHILE 1 < 2 must not hold a worker forever
+    static constexpr std::chrono::milliseconds DEFAULT_TIMEOUT{10000};
+
+ private:
+    struct Connection {
+        std::string in;
+        std::string out;
+        size_t written = 0;
+        bool watched = false;  // registered with epoll
+    };
+
+    void acceptAll();
+    void readFrom(int fd);
+    void dispatch(int fd);
+    void completeAll();
+    void startWrite(int fd, std::string&& response);
+    void writeTo(int fd);
+    void watch(int fd, uint32_t events);
+    void unwatch(int fd);
+    void closeConnection(int fd);
+    /*
+    * Runs on a worker thread.
+    */
+    std::string handle(const std::string& request);
+
+    std::string socketPath_;
+    ThreadPool& pool_;
+    ExecutionLimits limits_;
+    int listenFd_ = -1;
+    int epollFd_ = -1;
+    int wakeFd_ = -1;
+    bool stopping_ = false;
+    std::unordered_map<int, Connection> connections_;
+    ProgramCache cache_;
+
+    std::mutex doneMutex_;
+    std::vector<std::pair<int, std::string>> done_;
+    size_t inFlight_ = 0;    // tasks submitted and not yet done, under doneMutex_
+};
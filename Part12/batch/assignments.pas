@@ -0,0 +1,13 @@
+PROGRAM Assignments;
+VAR
+   number, a, b, c, x : INTEGER;
+   y : REAL;
+
+BEGIN {Assignments}
+   number := 2;
+   a := number;
+   b := 10 * a + 10 * number DIV 4;
+   c := a - - b;
+   x := 11;
+   y := 20 / 7 + 3.14;
+END.  {Assignments}
@@ -0,0 +1,9 @@
+PROGRAM Counted;
+VAR
+   i, s : INTEGER;
+
+BEGIN {Counted}
+   s := 0;
+   FOR i := 1 TO 1000 DO
+      s := s + i DIV 3
+END.  {Counted}
@@ -0,0 +1,14 @@
+PROGRAM DivZero;
+VAR
+   d, s : INTEGER;
+
+{ fails in its fifth iteration, the rest of the batch still runs }
+BEGIN {DivZero}
+   d := 5;
+   s := 0;
+   WHILE d > -5 DO
+   BEGIN
+      d := d - 1;
+      s := s + 100 DIV d
+   END
+END.  {DivZero}